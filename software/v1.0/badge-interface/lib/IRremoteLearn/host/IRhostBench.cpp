@@ -0,0 +1,611 @@
+/*
+ * IRremoteLearn: IRhostBench - runs the capture and decoders on Linux
+ *
+ * With a trace file argument, replays it and prints every frame decoded from it.
+ * Without one, sends synthetic BYTES frames and reports how many came back intact
+ * and the bit rate on air. -w sweeps the jitter for both PHYs plain and IR_PHY_PPM4 FEC coded
+ * instead.
+ * -x corrupts every frame decoded from the trace, or synthetic frames without one, and
+ * counts the corruptions crc8() and crc16() let through, then times both.
+ * -m classifies every MARK/SPACE pair of the frames decoded from the trace, or of synthetic
+ * frames, against the NEC timings with the integer ir_match_window() tables and with the
+ * double precision windows they replaced, checks both agree and times them.
+ * -r times each end of frame mode from the last edge of a frame to it being queued for
+ * decode(), polled every poll_us like loop() would, for BYTES frames and 32-bit NEC codes.
+ * -a walks 13 byte frames as encodeBytes() sends them, the way the sendSymbolsAsync() thread
+ * does, on 1 ms OS ticks at a random phase, and reports how much of the airtime it sleeps.
+ *
+ * IRhostBench [-f min_pulse_us] [-e idle_gap_us] [-t trace.bin] trace.txt
+ * IRhostBench [-f min_pulse_us] [-e idle_gap_us] [-t trace.bin] [-p] [-c] -n frames -j jitter_us -s skew_ppm -l stretch_us -g glitch_permille
+ * IRhostBench [-f min_pulse_us] [-e idle_gap_us] -w -n frames -s skew_ppm -l stretch_us -g glitch_permille
+ * IRhostBench [-f min_pulse_us] [-e idle_gap_us] -x [-n frames] [trace.txt]
+ * IRhostBench [-f min_pulse_us] [-e idle_gap_us] -m [-n frames -j jitter_us -s skew_ppm -l stretch_us] [trace.txt]
+ * IRhostBench [-e idle_gap_us] [-p] [-c] [-k] -r poll_us [-n frames]
+ * IRhostBench -a [-n frames]
+ *
+ * -f turns on IRrecv::setGlitchFilter() with the header gate, -e selects IR_EOF_IDLE,
+ * -t trace.bin writes IRrecv::setTrace() records for IRtraceReader, -p sends IR_PHY_PPM4 frames,
+ * -c sends IR_FMT_FEC frames (with -p only), -k IR_FMT_CRC16 frames, -l stretches every mark into
+ * the space after it.
+ */
+
+#include "IRremoteLearn.h"
+#include "IRremoteLearnInt.h"
+
+IRrecv irrecv(RX);
+IRsend irsend(TX);
+decode_results results;
+
+// IRrecv::setTrace() output to a file
+class FilePrint : public Print {
+public:
+    FilePrint(FILE *file) : file(file) {}
+    using Print::write;
+    size_t write(uint8_t c) { return fputc(c, file) == EOF ? 0 : 1; }
+    size_t write(const uint8_t *buf, size_t len) { return fwrite(buf, 1, len, file); }
+private:
+    FILE *file;
+};
+
+static double seconds() {
+    return micros() / 1000000.0;
+}
+
+// BYTES frames decoded by replay(), for the -x corruption test
+#define CORPUS_MAX 4096
+static uint8_t corpus[CORPUS_MAX][RX_BUF_MAX];
+static int corpus_len[CORPUS_MAX];
+static int corpus_frames = 0;
+
+// MARK/SPACE pairs of the frames decoded by replay() and synthetic(), for the -m benchmark
+#define PAIRS_MAX (1 << 20)
+static uint16_t pairs[PAIRS_MAX][2];
+static int pair_count = 0;
+static bool collecting = false;
+
+static void collect(const decode_results *results) {
+    for (unsigned long i = 0; collecting && i + 1 < results->rawlen && pair_count < PAIRS_MAX; i += 2) {
+        pairs[pair_count][0] = ir_raw_us(results->rawbuf[i]);
+        pairs[pair_count][1] = ir_raw_us(results->rawbuf[i + 1]);
+        pair_count++;
+    }
+}
+
+static int replay(const char *path, bool quiet) {
+    IRReplayEdgeSource trace;
+    if (!trace.open(path)) {
+        fprintf(stderr, "can't open %s\n", path);
+        return 1;
+    }
+    irrecv.setEdgeSource(&trace);
+    irrecv.enableIRIn();
+
+    unsigned long decoded = 0;
+    int idle = 0;
+    double start = seconds();
+    // failed frames are dropped by decode() one per call, so keep going until the queue is surely empty
+    while (!trace.done() || idle < IR_FRAME_QUEUE) {
+        if (irrecv.decode(&results)) {
+            decoded++;
+            collect(&results);
+            if (results.decode_type == BYTES && corpus_frames < CORPUS_MAX) {
+                memcpy(corpus[corpus_frames], &results.rx_data[1], results.rx_len - 2);
+                corpus_len[corpus_frames++] = results.rx_len - 2;
+            }
+            if (!quiet) {
+                printf("%lu:", results.seq);
+                for (int i = 0; i < results.rx_len; i++) {
+                    printf(" %02x", results.rx_data[i]);
+                }
+                printf("\n");
+            }
+            irrecv.resume();
+            idle = 0;
+        } else if (trace.done()) {
+            idle++;
+        }
+    }
+    double elapsed = seconds() - start;
+    irrecv.disableIRIn();
+    irrecv_stats_t stats;
+    irrecv.stats(&stats);
+    printf("%lu frames, %lu decoded, %lu dropped, %lu glitches, %.0f frames/s\n", stats.frames, decoded,
+            stats.frames_dropped, stats.glitches, stats.frames / elapsed);
+    return 0;
+}
+
+typedef struct {
+    int good;
+    double bps;     // payload bits per second on air, header, LENGTH and CRC included in the time
+    double elapsed; // host seconds
+    irquality_t worst; // largest deviations and smallest header margin of the intact frames
+    unsigned long dev_sum_us, marginal, symbols;
+} run_t;
+
+#define BENCH_PEERS 4 // sender IDs in the first 4 DATA bytes of synthetic frames long enough
+
+static run_t synthetic(int count, unsigned long jitter_us, long skew_ppm, long stretch_us, unsigned int glitch_permille,
+        uint8_t phy, uint8_t format) {
+    IRSyntheticEdgeSource generator(jitter_us, skew_ppm, glitch_permille, stretch_us);
+    irrecv.setEdgeSource(&generator);
+    irrecv.enableIRIn();
+
+    run_t run = { 0, 0, 0, { 0, 0, 0, 0, INT16_MAX }, 0, 0, 0 };
+    unsigned long bits = 0;
+    double start = seconds();
+    for (int n = 0; n < count; n++) {
+        uint8_t data[TX_BUF_MAX];
+        int len = 1 + rand() % 12;
+        for (int i = 0; i < len; i++) {
+            data[i] = rand();
+        }
+        if (len >= 4) {
+            uint32_t id = 0x0bad0000 + rand() % BENCH_PEERS;
+            memcpy(data, &id, 4);
+        }
+        generator.sendBytes(data, len, phy, format);
+        bits += len * 8;
+        // failed frames are dropped by decode() one per call, keep the queue from backing up
+        for (int i = 0; i < IR_FRAME_QUEUE; i++) {
+            if (irrecv.decode(&results)) {
+                collect(&results);
+                if (results.rx_len == len + 2 && !memcmp(&results.rx_data[1], data, len) && results.phy == phy &&
+                        results.format == format) {
+                    run.good++;
+                    run.dev_sum_us += (unsigned long)results.quality.mean_dev_us * results.quality.symbols;
+                    run.symbols += results.quality.symbols;
+                    run.marginal += results.quality.marginal;
+                    if (results.quality.max_dev_us > run.worst.max_dev_us) {
+                        run.worst.max_dev_us = results.quality.max_dev_us;
+                    }
+                    if (results.quality.header_margin_us < run.worst.header_margin_us) {
+                        run.worst.header_margin_us = results.quality.header_margin_us;
+                    }
+                }
+                irrecv.resume();
+            }
+        }
+    }
+    run.elapsed = seconds() - start;
+    run.bps = bits / (generator.airtime() / 1000000.0);
+    irrecv.disableIRIn();
+    return run;
+}
+
+static const char *phy_name(uint8_t phy, uint8_t format) {
+    if (format & IR_FMT_FEC) {
+        return (phy == IR_PHY_PPM4) ? "ppm4+fec" : "nec+fec";
+    }
+    return (phy == IR_PHY_PPM4) ? "ppm4" : "nec";
+}
+
+// Frame error rate and bit rate of both PHYs plain and of IR_PHY_PPM4 FEC coded, for growing
+// jitter. IR_PHY_NEC frames aren't coded, see ir_bytes_schedule().
+static int sweep(int count, long skew_ppm, long stretch_us, unsigned int glitch_permille) {
+    printf("jitter_us");
+    for (uint8_t format = 0; format <= IR_FMT_FEC; format += IR_FMT_FEC) {
+        for (uint8_t phy = format ? IR_PHY_PPM4 : IR_PHY_NEC; phy <= IR_PHY_PPM4; phy++) {
+            printf("  %8s_fer  %8s_bps", phy_name(phy, format), phy_name(phy, format));
+        }
+    }
+    printf("\n");
+    for (unsigned long jitter_us = 0; jitter_us <= 200; jitter_us += 25) {
+        printf("%9lu", jitter_us);
+        for (uint8_t format = 0; format <= IR_FMT_FEC; format += IR_FMT_FEC) {
+            for (uint8_t phy = format ? IR_PHY_PPM4 : IR_PHY_NEC; phy <= IR_PHY_PPM4; phy++) {
+                run_t run = synthetic(count, jitter_us, skew_ppm, stretch_us, glitch_permille, phy, format);
+                printf("  %11.2f%%  %12.0f", 100.0 * (count - run.good) / count, run.bps);
+            }
+        }
+        printf("\n");
+    }
+    return 0;
+}
+
+// Flip bits of len bytes in data the way the pattern says, at least one
+static void corrupt(uint8_t *data, int len, int pattern) {
+    int bits = len * 8;
+    if (pattern == 0) {
+        // the same bit in two bytes, invisible to an XOR
+        int bit = rand() % 8;
+        int a = rand() % len, b = (a + 1 + rand() % (len - 1)) % len;
+        data[a] ^= 1 << bit;
+        data[b] ^= 1 << bit;
+    } else if (pattern == 1) {
+        // 2 to 4 bits anywhere
+        for (int n = 2 + rand() % 3; n; n--) {
+            int bit = rand() % bits;
+            data[bit / 8] ^= 0x80 >> (bit % 8);
+        }
+    } else {
+        // a burst of up to 16 bits, first and last flipped
+        int burst = 2 + rand() % 15;
+        int start = rand() % (bits - burst + 1);
+        for (int i = 0; i < burst; i++) {
+            if (i == 0 || i == burst - 1 || (rand() & 1)) {
+                data[(start + i) / 8] ^= 0x80 >> ((start + i) % 8);
+            }
+        }
+    }
+}
+
+// Corruptions of the corpus frames each check lets through, and the time a check takes
+static int corruption(int trials) {
+    static const char *patterns[] = { "double", "random", "burst" };
+    printf("%d frames, %d corruptions each\n", corpus_frames, trials);
+    printf("pattern  crc8_false_accepts  crc16_false_accepts\n");
+    for (int pattern = 0; pattern < 3; pattern++) {
+        unsigned long tried = 0, crc8_accepts = 0, crc16_accepts = 0;
+        for (int f = 0; f < corpus_frames; f++) {
+            int len = corpus_len[f];
+            if (len < 2) {
+                continue;
+            }
+            uint8_t crc8_sent = crc8(corpus[f], len);
+            uint16_t crc16_sent = crc16(corpus[f], len);
+            for (int t = 0; t < trials; t++) {
+                uint8_t data[RX_BUF_MAX];
+                memcpy(data, corpus[f], len);
+                corrupt(data, len, pattern);
+                if (!memcmp(data, corpus[f], len)) {
+                    continue; // the flips cancelled out
+                }
+                tried++;
+                crc8_accepts += crc8(data, len) == crc8_sent;
+                crc16_accepts += crc16(data, len) == crc16_sent;
+            }
+        }
+        printf("%-7s  %9lu %7.3f%%  %10lu %7.3f%%\n", patterns[pattern], crc8_accepts,
+                100.0 * crc8_accepts / (tried ? tried : 1), crc16_accepts, 100.0 * crc16_accepts / (tried ? tried : 1));
+    }
+
+    // cost of checking a 13 byte game message
+    const int rounds = 1000000;
+    uint8_t message[13];
+    for (int i = 0; i < 13; i++) {
+        message[i] = rand();
+    }
+    volatile uint16_t sink = 0;
+    double start = seconds();
+    for (int i = 0; i < rounds; i++) {
+        message[0] = i;
+        sink += crc8(message, sizeof(message));
+    }
+    double crc8_us = (seconds() - start) * 1000000.0 / rounds;
+    start = seconds();
+    for (int i = 0; i < rounds; i++) {
+        message[0] = i;
+        sink += crc16(message, sizeof(message));
+    }
+    double crc16_us = (seconds() - start) * 1000000.0 / rounds;
+    printf("13 byte message: crc8 %.3f us, crc16 %.3f us\n", crc8_us, crc16_us);
+    return 0;
+}
+
+// Delivers the edges of one frame as its clock passes them, the way the pin interrupt
+// would, while the bench calls decode() every poll_us like loop() does
+class PacedEdgeSource : public IREdgeSource {
+public:
+    PacedEdgeSource() : clock(0), count(0), next(0) {}
+    void begin(int rxpin) {}
+    void end() {}
+    unsigned long now() { return clock; }
+    void pump() {
+        for (; next < count && edges[next] <= clock; next++) {
+            ir_edge_push(edges[next], (next % 2) ? SPACE : MARK);
+        }
+    }
+    // MARK first, returns the time of the last edge, the end of the trailing mark
+    unsigned long load(const uint16_t *durations, int n) {
+        unsigned long t = clock + 10000;
+        for (count = 0; count < n; count++) {
+            edges[count] = t;
+            t += durations[count];
+        }
+        edges[count++] = t;
+        next = 0;
+        return t;
+    }
+    unsigned long clock;
+private:
+    unsigned long edges[IR_TX_SCHEDULE + 1];
+    int count, next;
+};
+
+// A 32-bit NEC code, which no LENGTH byte closes
+static int nec_schedule(uint16_t *schedule, uint32_t code) {
+    int n = 0;
+    schedule[n++] = NEC_HDR_MARK;
+    schedule[n++] = NEC_HDR_SPACE;
+    for (int i = 0; i < NEC_BITS; i++, code <<= 1) {
+        schedule[n++] = NEC_BIT_MARK;
+        schedule[n++] = (code & TOPBIT) ? NEC_ONE_SPACE : NEC_ZERO_SPACE;
+    }
+    schedule[n++] = NEC_BIT_MARK;
+    return n;
+}
+
+// Edge to frame ready latency of both end of frame modes
+static int latency(int count, unsigned long poll_us, unsigned long idle_gap_us, uint8_t phy, uint8_t format) {
+    static const char *modes[] = { "window", "idle" };
+    PacedEdgeSource source;
+    irrecv.setEdgeSource(&source);
+    printf("polled every %luus, idle gap %luus\n", poll_us, idle_gap_us);
+    printf("mode    frames  %8s_mean  %8s_max  nec_code_mean  nec_code_max\n", phy_name(phy, format), phy_name(phy, format));
+    for (uint8_t mode = IR_EOF_WINDOW; mode <= IR_EOF_IDLE; mode++) {
+        irrecv.setEndOfFrame(mode, idle_gap_us);
+        irrecv.enableIRIn();
+        unsigned long sum[2] = { 0, 0 }, worst[2] = { 0, 0 }, ready[2] = { 0, 0 };
+        for (int n = 0; n < count; n++) {
+            int kind = n % 2;
+            uint16_t schedule[IR_TX_SCHEDULE];
+            int len = 1 + rand() % 12;
+            uint8_t data[TX_BUF_MAX];
+            for (int i = 0; i < len; i++) {
+                data[i] = rand();
+            }
+            int durations = kind ? nec_schedule(schedule, ((uint32_t)rand() << 16) ^ rand()) :
+                    ir_bytes_schedule(schedule, data, len, phy, format);
+            unsigned long last = source.load(schedule, durations);
+            for (unsigned long start = source.clock; source.clock - start < 1000000; source.clock += poll_us) {
+                if (irrecv.decode(&results)) {
+                    irrecv.resume();
+                }
+                // ready once the capture that got the last edge is closed
+                if (source.clock >= last && irparams.rcvstate == STATE_IDLE) {
+                    unsigned long us = source.clock - last;
+                    sum[kind] += us;
+                    worst[kind] = (us > worst[kind]) ? us : worst[kind];
+                    ready[kind]++;
+                    break;
+                }
+            }
+            source.clock += 50000; // quiet line between frames
+            while (irrecv.decode(&results)) {
+                irrecv.resume();
+            }
+        }
+        irrecv.disableIRIn();
+        printf("%-6s  %6lu  %11.0fus  %10luus  %11.0fus  %10luus\n", modes[mode], ready[0] + ready[1],
+                ready[0] ? (double)sum[0] / ready[0] : 0.0, worst[0], ready[1] ? (double)sum[1] / ready[1] : 0.0, worst[1]);
+    }
+    return 0;
+}
+
+// How much of a 13 byte game message's airtime the transmit thread leaves loop(): it sleeps
+// ir_send_sleep_ms() of every wait, a sleep of n ms ending on the n-th tick from now
+static int txshare(int count) {
+    static const uint8_t configs[][2] = { { IR_PHY_NEC, 0 }, { IR_PHY_PPM4, 0 }, { IR_PHY_PPM4, IR_FMT_FEC },
+            { IR_PHY_PPM4, IR_FMT_FEC | IR_FMT_CRC16 } };
+    uint8_t message[13];
+    for (int i = 0; i < 13; i++) {
+        message[i] = rand();
+    }
+    printf("frame           airtime  loop()  share\n");
+    for (unsigned c = 0; c < sizeof(configs) / sizeof(configs[0]); c++) {
+        const irsymbols_t *symbols = irsend.encodeBytes(message, sizeof(message), configs[c][0], configs[c][1]);
+        if (!symbols) {
+            continue;
+        }
+        double slept = 0, air = 0;
+        for (int n = 0; n < count; n++) {
+            unsigned long tick = rand() % 1000; // first tick after the frame starts
+            unsigned long now = 0, deadline = 0;
+            for (int i = 0; i < symbols->count; i++) {
+                deadline += symbols->durations[i];
+                unsigned long ms = ir_send_sleep_ms((long)(deadline - now));
+                if (ms) {
+                    while (tick <= now) {
+                        tick += 1000;
+                    }
+                    slept += tick + (ms - 1) * 1000 - now;
+                }
+                now = deadline; // busy-waited
+            }
+            air += deadline;
+        }
+        char name[24];
+        snprintf(name, sizeof(name), "%s%s", phy_name(configs[c][0], configs[c][1]),
+                (configs[c][1] & IR_FMT_CRC16) ? "+crc16" : "");
+        printf("%-14s  %5.1fms  %4.1fms  %4.1f%%\n", name, air / count / 1000,
+                slept / count / 1000, 100.0 * slept / air);
+        irsend.release(symbols);
+    }
+    return 0;
+}
+
+// The windows before ir_match_window(): double multiplies by the tolerances on every
+// call, out of line like the MATCH functions were. Doubles are soft float on the device.
+#define LTOL (1.0 - TOLERANCE/100.)
+#define UTOL (1.0 + TOLERANCE/100.)
+
+__attribute__((noipa)) static int match_double(int measured, int desired) {
+    return measured >= (int)(desired * LTOL / USECPERTICK) && measured <= (int)(desired * UTOL / USECPERTICK + 1);
+}
+
+static int match_mark_double(int measured, int desired) {
+    return match_double(measured, desired + MARK_EXCESS);
+}
+
+static int match_space_double(int measured, int desired) {
+    return match_double(measured, desired - MARK_EXCESS);
+}
+
+// A pair as decodeNEC() and decodeBytes() tell them apart: 2 for the header, the bit, or -1
+static int classify_double(int mark, int space) {
+    if (match_mark_double(mark, NEC_HDR_MARK) && match_space_double(space, NEC_HDR_SPACE)) {
+        return 2;
+    }
+    if (!match_mark_double(mark, NEC_BIT_MARK)) {
+        return -1;
+    }
+    if (match_space_double(space, NEC_ONE_SPACE)) {
+        return 1;
+    }
+    return match_space_double(space, NEC_ZERO_SPACE) ? 0 : -1;
+}
+
+static int classify_window(int mark, int space) {
+    if (MATCH_MARK(mark, NEC_HDR_MARK) && MATCH_SPACE(space, NEC_HDR_SPACE)) {
+        return 2;
+    }
+    if (!MATCH_MARK(mark, NEC_BIT_MARK)) {
+        return -1;
+    }
+    if (MATCH_SPACE(space, NEC_ONE_SPACE)) {
+        return 1;
+    }
+    return MATCH_SPACE(space, NEC_ZERO_SPACE) ? 0 : -1;
+}
+
+// Both classifications of the collected pairs, how often they disagree and what each costs
+static int matching() {
+    if (!pair_count) {
+        printf("no frames decoded\n");
+        return 1;
+    }
+    unsigned long disagree = 0, bits = 0;
+    for (int i = 0; i < pair_count; i++) {
+        int symbol = classify_window(pairs[i][0], pairs[i][1]);
+        disagree += symbol != classify_double(pairs[i][0], pairs[i][1]);
+        bits += symbol == 0 || symbol == 1;
+    }
+    int rounds = 1 + 20000000 / pair_count;
+    volatile int sink = 0;
+    double start = seconds();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < pair_count; i++) {
+            sink += classify_double(pairs[i][0], pairs[i][1]);
+        }
+    }
+    double double_ns = (seconds() - start) * 1e9 / ((double)rounds * pair_count);
+    start = seconds();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < pair_count; i++) {
+            sink += classify_window(pairs[i][0], pairs[i][1]);
+        }
+    }
+    double window_ns = (seconds() - start) * 1e9 / ((double)rounds * pair_count);
+    printf("%d pairs, %lu bits, %lu classified differently\n", pair_count, bits, disagree);
+    printf("per pair: double %.2f ns, integer windows %.2f ns, %.1fx\n", double_ns, window_ns,
+            window_ns > 0 ? double_ns / window_ns : 0.0);
+    return disagree ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    int count = 10000;
+    bool sweeping = false;
+    bool corrupting = false;
+    bool classifying = false;
+    bool sharing = false;
+    unsigned long poll_us = 0;
+    unsigned long idle_gap_us = 5000;
+    uint8_t phy = IR_PHY_NEC;
+    uint8_t format = 0;
+    unsigned long jitter_us = 0;
+    long skew_ppm = 0;
+    long stretch_us = 0;
+    unsigned int glitch_permille = 0;
+    const char *path = NULL;
+    FILE *trace = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            count = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            jitter_us = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            skew_ppm = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "-l") && i + 1 < argc) {
+            stretch_us = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "-g") && i + 1 < argc) {
+            glitch_permille = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+            irrecv.setGlitchFilter(atol(argv[++i]), true);
+        } else if (!strcmp(argv[i], "-e") && i + 1 < argc) {
+            idle_gap_us = atol(argv[++i]);
+            irrecv.setEndOfFrame(IR_EOF_IDLE, idle_gap_us);
+        } else if (!strcmp(argv[i], "-p")) {
+            phy = IR_PHY_PPM4;
+        } else if (!strcmp(argv[i], "-c")) {
+            format |= IR_FMT_FEC;
+        } else if (!strcmp(argv[i], "-k")) {
+            format |= IR_FMT_CRC16;
+        } else if (!strcmp(argv[i], "-x")) {
+            corrupting = true;
+        } else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+            poll_us = atol(argv[++i]);
+        } else if (!strcmp(argv[i], "-a")) {
+            sharing = true;
+        } else if (!strcmp(argv[i], "-m")) {
+            classifying = true;
+        } else if (!strcmp(argv[i], "-w")) {
+            sweeping = true;
+        } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            trace = fopen(argv[++i], "wb");
+        } else {
+            path = argv[i];
+        }
+    }
+    if ((format & IR_FMT_FEC) && phy != IR_PHY_PPM4) {
+        fprintf(stderr, "-c needs -p, IR_FMT_FEC frames only go on IR_PHY_PPM4\n");
+        return 1;
+    }
+    irrecv.setPeerId(1);
+    FilePrint trace_out(trace);
+    if (trace) {
+        irrecv.setTrace(&trace_out);
+    }
+    int rv = 0;
+    if (sharing) {
+        rv = txshare(count);
+    } else if (poll_us) {
+        rv = latency(count, poll_us, idle_gap_us, phy, format);
+    } else if (classifying) {
+        collecting = true;
+        if (path) {
+            rv = replay(path, true);
+        } else {
+            synthetic(count, jitter_us, skew_ppm, stretch_us, glitch_permille, phy, format);
+        }
+        if (!rv) {
+            rv = matching();
+        }
+    } else if (corrupting) {
+        if (path) {
+            rv = replay(path, true);
+        } else {
+            for (corpus_frames = 0; corpus_frames < count && corpus_frames < CORPUS_MAX; corpus_frames++) {
+                corpus_len[corpus_frames] = 1 + rand() % 12;
+                for (int i = 0; i < corpus_len[corpus_frames]; i++) {
+                    corpus[corpus_frames][i] = rand();
+                }
+            }
+        }
+        if (!rv) {
+            rv = corruption(1000);
+        }
+    } else if (path) {
+        rv = replay(path, false);
+    } else if (sweeping) {
+        rv = sweep(count, skew_ppm, stretch_us, glitch_permille);
+    } else {
+        run_t run = synthetic(count, jitter_us, skew_ppm, stretch_us, glitch_permille, phy, format);
+        irrecv_stats_t stats;
+        irrecv.stats(&stats);
+        printf("%s%s: %d/%d frames intact (%.2f%%), %.0f bit/s on air, %.0f frames/s, %lu bits corrected\n",
+                phy_name(phy, format), (format & IR_FMT_CRC16) ? "+crc16" : "", run.good, count, 100.0 * run.good / count, run.bps, count / run.elapsed,
+                stats.fec_corrected);
+        printf("calibrated %lu frames: stretch %ldus, skew %ldppm on average\n", stats.calibrated, stats.stretch_us_avg,
+                stats.skew_ppm_avg);
+        printf("link: %.0fus mean and %uus max deviation, %.2f%% marginal, %dus header margin at the least, "
+                "%lu CRC failures, %lu decode errors\n", run.symbols ? (double)run.dev_sum_us / run.symbols : 0.0,
+                run.worst.max_dev_us, run.symbols ? 100.0 * run.marginal / run.symbols : 0.0,
+                run.worst.header_margin_us, stats.crc_failures, stats.decode_errors);
+        irrecv.dumpPeers(&Serial);
+    }
+    if (trace) {
+        fclose(trace);
+    }
+    return rv;
+}
@@ -0,0 +1,391 @@
+/*
+ * IRremoteLearn: IRmatchSim - a model of matches between two badges on Linux
+ *
+ * Runs two GameMachine (badge-game.cpp) instances on a virtual clock. The game table
+ * below is a copy of the badge firmware's, and its handlers and processMessage() keep
+ * only what the firmware's do from the COUNTER_ATTACK on, so keep them in step with
+ * particle-bamf23-badge.cpp by hand. Frames take as long on air as ir_bytes_schedule() makes them,
+ * on the PHY and format the firmware picks from the other badge's caps, and go out
+ * once the other badge is quiet (IRsend::setCarrierSense()). A frame is lost at random
+ * at the given rate, or when the receiver was sending at the time.
+ * Badges don't decode during their splash or result display and block in fadeOut(),
+ * like the firmware's loop().
+ *
+ * Badge A has attacked, badge B rolled and counters. For every pairing of badges that
+ * send MESSAGE_CAPS_V2 or not and loss rate, prints how many matches both badges finished,
+ * how long from B's first COUNTER_ATTACK until each showed the result, and the frames
+ * sent. -r adds both badges' round trip times and resends (GameMachine::printRtt()),
+ * -g logs their sends and timeouts.
+ *
+ * A badge without MESSAGE_CAPS_V2 is this firmware built with the bit left out, like the
+ * interface: it still sends the caps byte and runs GameMachine. v1 firmware isn't modelled.
+ *
+ * IRmatchSim [-n matches] [-l loss_percent] [-r] [-g]
+ */
+
+#include "IRremoteLearn.h"
+#include "IRremoteLearnInt.h"
+#include "badge-game.h"
+
+// Copies of the firmware's GAMEPLAY_STATE_* and gameTable, with the handlers below
+#define GAMEPLAY_STATE_IDLE                 (0)
+#define GAMEPLAY_STATE_ATTACK               (1)
+#define GAMEPLAY_STATE_ATTACK_ACK           (2)
+#define GAMEPLAY_STATE_COUNTER_ATTACK       (3)
+#define GAMEPLAY_STATE_COUNTER_ATTACK_ACK   (4)
+#define GAMEPLAY_STATE_RESULT               (5)
+#define GAMEPLAY_STATE_RESULT_ACK           (6)
+#define GAMEPLAY_STATE_SCORE_ACK            (7)
+#define GAMEPLAY_STATE_RESULT_DISPLAY       (8)
+#define GAMEPLAY_STATE_COUNTER_RESULT       (9)
+#define GAMEPLAY_STATE_COUNT                (10)
+#define GAME_STATE_TIMEOUT_MS               (8000)
+
+#define SPLASH_MS       (1200)  // the attack's sound
+#define DISPLAY_MS      (1000)  // the result's sound, then fadeOut(2000)
+#define DECODE_MS       (5)     // last edge to decode(), IR_EOF_IDLE
+#define MATCH_MAX_MS    (20000) // give up on a match after
+
+void resetGame();
+void attackSent();
+void gameOver();
+void extendWakeTime() {}
+
+constexpr GameState gameTable[GAMEPLAY_STATE_COUNT] = {
+   // state                              name              message                      reply                    sends flags rto_ms timeout_ms             onEnter  onSend          onSent    onFrame  onTimeout
+    { GAMEPLAY_STATE_IDLE,               "IDLE",           GAME_NO_MESSAGE,             GAME_NO_MESSAGE,         0,    0,    0,     0,                     nullptr, nullptr,        nullptr,  nullptr, nullptr },
+    { GAMEPLAY_STATE_ATTACK,             "ATTACK",         MESSAGE_TYPE_ATTACK,         GAME_NO_MESSAGE,         1,    0,    0,     GAME_STATE_TIMEOUT_MS, nullptr, attackSent,     nullptr,  nullptr, resetGame },
+    { GAMEPLAY_STATE_ATTACK_ACK,         "ATTACK_ACK",     GAME_NO_MESSAGE,             GAME_NO_MESSAGE,         0,    0,    0,     GAME_STATE_TIMEOUT_MS, nullptr, nullptr,        nullptr,  nullptr, resetGame },
+    { GAMEPLAY_STATE_COUNTER_ATTACK,     "COUNTER",        MESSAGE_TYPE_COUNTER_ATTACK, MESSAGE_TYPE_RESULT,     4,    0,    3000,  GAME_STATE_TIMEOUT_MS, nullptr, attackSent,     nullptr,  nullptr, resetGame },
+    { GAMEPLAY_STATE_COUNTER_ATTACK_ACK, "COUNTER_ACK",    MESSAGE_TYPE_RESULT_ACK,     GAME_NO_MESSAGE,         1,    0,    0,     GAME_STATE_TIMEOUT_MS, nullptr, extendWakeTime, nullptr,  nullptr, resetGame },
+    { GAMEPLAY_STATE_RESULT,             "RESULT",         MESSAGE_TYPE_RESULT,         MESSAGE_TYPE_RESULT_ACK, 5,    0,    1000,  GAME_STATE_TIMEOUT_MS, nullptr, extendWakeTime, nullptr,  nullptr, resetGame },
+    { GAMEPLAY_STATE_RESULT_ACK,         "RESULT_ACK",     MESSAGE_TYPE_RESULT_ACK,     GAME_NO_MESSAGE,         1,    0,    0,     0,                     nullptr, extendWakeTime, gameOver, nullptr, nullptr },
+    { GAMEPLAY_STATE_SCORE_ACK,          "SCORE_ACK",      GAME_NO_MESSAGE,             GAME_NO_MESSAGE,         0,    0,    0,     0,                     nullptr, nullptr,        nullptr,  nullptr, nullptr },
+    { GAMEPLAY_STATE_RESULT_DISPLAY,     "RESULT_DISPLAY", GAME_NO_MESSAGE,             GAME_NO_MESSAGE,         0,    0,    0,     0,                     nullptr, nullptr,        nullptr,  nullptr, nullptr },
+    { GAMEPLAY_STATE_COUNTER_RESULT,     "COUNTER_V2",     MESSAGE_TYPE_COUNTER_ATTACK, MESSAGE_TYPE_RESULT_ACK, 4,    0,    1000,  GAME_STATE_TIMEOUT_MS, nullptr, attackSent,     nullptr,  nullptr, resetGame },
+};
+static_assert(gameTableValid(gameTable, GAMEPLAY_STATE_COUNT), "gameTable rows out of order or incomplete");
+
+enum { BADGE_IDLE, BADGE_SPLASH, BADGE_DISPLAY_RESULT };
+
+struct Frame {
+    unsigned long start_ms;
+    unsigned long end_ms;
+    uint8_t data[MESSAGE_MAX_LEN];
+    int len;
+};
+
+// One badge: its side of the match and what its loop() is busy with
+struct Badge {
+    const char *name;
+    uint32_t id;
+    uint8_t caps;
+    uint8_t peerCaps;
+    IRMessage msg;               // its roll, player1msg
+    IRMessage peerMsg;           // the other badge's roll, player2msg
+    uint8_t buf[MESSAGE_MAX_LEN];
+    GameMachine *game;
+    int badgeState;
+    int gameStateP2;
+    unsigned long blockedUntil;  // in a blocking fadeOut()
+    unsigned long stateUntil;    // end of the splash or the result display
+    unsigned long txStart, txEnd;
+    Frame air[8];                // frames on their way to this badge
+    int airCount;
+    Frame queue[IR_FRAME_QUEUE - 1]; // captured, waiting for decode()
+    int queueCount;
+    unsigned long shownAt;       // 0 until it shows the result
+    bool failed;
+    unsigned long frames;
+};
+
+IRsend irsend(TX);
+decode_results irResults;
+Badge badges[2];
+Badge *self;                     // the badge whose loop() runs, for the handlers
+Badge *other;
+int lossPercent;
+
+void resetGame() {
+    self->failed = self->shownAt == 0;
+    self->game->enter(GAMEPLAY_STATE_IDLE);
+    self->gameStateP2 = GAMEPLAY_STATE_IDLE;
+    self->peerCaps = 0;
+}
+
+void attackSent() {
+    self->blockedUntil = millis() + 500; // fadeOut(500)
+}
+
+void gameOver() {
+    self->game->enter(GAMEPLAY_STATE_IDLE);
+    self->gameStateP2 = GAMEPLAY_STATE_IDLE;
+}
+
+void createMessage(uint8_t *buf, int msgType) {
+    IRMessage msg = {};
+    msg.type = msgType;
+    memset(buf, 0, MESSAGE_MAX_LEN);
+    switch (msgType) {
+        case MESSAGE_TYPE_COUNTER_ATTACK: {
+            MessageWriter<CounterAttackMessage> out(buf, self->caps);
+            out.set<FieldId>(self->id).set<FieldMsg>(self->msg).set<FieldScore>(0).set<FieldId2>(other->id).set<FieldMsg2>(self->peerMsg);
+            break;
+        }
+        case MESSAGE_TYPE_RESULT: {
+            MessageWriter<ResultMessage> out(buf, self->caps);
+            out.set<FieldId>(self->id).set<FieldMsg>(msg).set<FieldWinId>(other->id);
+            break;
+        }
+        case MESSAGE_TYPE_RESULT_ACK: {
+            MessageWriter<ResultAckMessage> out(buf, self->caps);
+            out.set<FieldId>(self->id).set<FieldMsg>(msg).set<FieldWinId>(badges[1].id);
+            break;
+        }
+    }
+}
+
+// The firmware's sendFrame(): on air for as long as ir_bytes_schedule() says
+bool sendFrame(uint8_t *buf, int len) {
+    uint8_t phy = (self->peerCaps & MESSAGE_CAPS_PPM4) ? IR_PHY_PPM4 : IR_PHY_NEC;
+    uint8_t format = 0;
+    if (phy == IR_PHY_PPM4) {
+        format |= (self->peerCaps & MESSAGE_CAPS_FEC) ? IR_FMT_FEC : 0;
+        format |= (self->peerCaps & MESSAGE_CAPS_CRC16) ? IR_FMT_CRC16 : 0;
+    }
+    static uint16_t schedule[IR_TX_SCHEDULE];
+    int count = ir_bytes_schedule(schedule, buf, len, phy, format);
+    unsigned long air_us = 0;
+    for (int i = 0; i < count; i++) {
+        air_us += schedule[i];
+    }
+    // listen before talk, like IRsend::setCarrierSense()
+    unsigned long start = millis();
+    for (int tries = 0; tries < IR_CSMA_MAX_TRIES && start >= other->txStart &&
+            start < other->txEnd + IR_CSMA_QUIET_US / 1000; tries++) {
+        start += random((IR_CSMA_SLOT_US << tries) / 1000);
+    }
+    self->txStart = start;
+    self->txEnd = start + air_us / 1000 + 1;
+    self->frames++;
+    if ((int)random(100) < lossPercent || other->airCount == 8) {
+        return true; // went out, lost on the way
+    }
+    Frame &f = other->air[other->airCount++];
+    f.start_ms = self->txStart;
+    f.end_ms = self->txEnd;
+    memcpy(f.data, buf, len);
+    f.len = len;
+    return true;
+}
+
+// The firmware's processMessage() for the messages of a match from the counter attack on
+void processMessage() {
+    decode_results *results = &irResults;
+    MessageReader in(results);
+    switch (in.type()) {
+        case MESSAGE_TYPE_COUNTER_ATTACK: {
+            self->peerCaps = in.caps();
+            self->peerMsg = in.get<FieldMsg>();
+            self->badgeState = BADGE_SPLASH;
+            self->stateUntil = millis() + SPLASH_MS;
+            self->gameStateP2 = GAMEPLAY_STATE_COUNTER_ATTACK;
+            IRMessage echo = in.get<FieldMsg2>();
+            if ((self->peerCaps & MESSAGE_CAPS_V2) && echo.type == self->msg.type &&
+                    echo.button == self->msg.button && echo.strength == self->msg.strength) {
+                createMessage(self->buf, MESSAGE_TYPE_RESULT_ACK);
+                self->game->enter(GAMEPLAY_STATE_COUNTER_ATTACK_ACK);
+            }
+            break;
+        }
+        case MESSAGE_TYPE_RESULT: {
+            createMessage(self->buf, MESSAGE_TYPE_RESULT_ACK);
+            self->badgeState = BADGE_DISPLAY_RESULT;
+            self->stateUntil = millis() + DISPLAY_MS;
+            self->shownAt = millis();
+            self->gameStateP2 = GAMEPLAY_STATE_RESULT_DISPLAY;
+            self->game->enter(GAMEPLAY_STATE_RESULT_ACK);
+            break;
+        }
+        case MESSAGE_TYPE_RESULT_ACK: {
+            self->badgeState = BADGE_DISPLAY_RESULT;
+            self->stateUntil = millis() + DISPLAY_MS;
+            self->shownAt = millis();
+            self->game->enter(GAMEPLAY_STATE_RESULT_DISPLAY);
+            break;
+        }
+    }
+}
+
+// Frames whose last edge was DECODE_MS ago are captured, unless they came while it sent
+void receive(Badge *b, unsigned long now) {
+    for (int i = 0; i < b->airCount; i++) {
+        Frame &f = b->air[i];
+        if (f.end_ms + DECODE_MS > now) {
+            continue;
+        }
+        bool collided = b->txEnd > f.start_ms && b->txStart < f.end_ms; // its receiver was off
+        if (!collided && b->queueCount < IR_FRAME_QUEUE - 1) {
+            b->queue[b->queueCount++] = f;
+        }
+        b->air[i--] = b->air[--b->airCount];
+    }
+}
+
+// The firmware's loop(), one pass
+void loop(Badge *b) {
+    unsigned long now = millis();
+    self = b;
+    other = (b == &badges[0]) ? &badges[1] : &badges[0];
+    receive(b, now);
+    if (now < b->blockedUntil) {
+        return;
+    }
+    if (b->badgeState == BADGE_IDLE && b->queueCount) {
+        Frame f = b->queue[0];
+        memmove(&b->queue[0], &b->queue[1], --b->queueCount * sizeof(Frame));
+        memset(&irResults, 0, sizeof(irResults));
+        irResults.rx_data[0] = f.len + 2;
+        memcpy(&irResults.rx_data[1], f.data, f.len);
+        irResults.rx_len = f.len + 2;
+        b->game->frame(&irResults);
+    } else if (b->badgeState == BADGE_SPLASH && now >= b->stateUntil) {
+        if (b->game->state() == GAMEPLAY_STATE_COUNTER_ATTACK_ACK) {
+            b->blockedUntil = now + 1000; // fadeOut(1000)
+            b->badgeState = BADGE_DISPLAY_RESULT;
+            b->stateUntil = b->blockedUntil + DISPLAY_MS;
+            b->shownAt = b->blockedUntil;
+            b->game->enter(GAMEPLAY_STATE_RESULT_DISPLAY);
+            return;
+        }
+        if (b->gameStateP2 == GAMEPLAY_STATE_COUNTER_ATTACK) {
+            createMessage(b->buf, MESSAGE_TYPE_RESULT);
+            b->game->enter(GAMEPLAY_STATE_RESULT);
+        }
+        b->blockedUntil = now + 1000; // fadeOut(1000)
+        b->badgeState = BADGE_IDLE;
+        return;
+    } else if (b->badgeState == BADGE_DISPLAY_RESULT && now >= b->stateUntil) {
+        b->blockedUntil = now + 2000; // fadeOut(2000)
+        b->badgeState = BADGE_IDLE;
+        resetGame();
+        return;
+    }
+    irparams.tx_busy = now < b->txEnd; // one transmitter per badge
+    b->game->poll();
+}
+
+struct Result {
+    int done;
+    unsigned long counter_ms;
+    unsigned long attacker_ms;
+    unsigned long frames;
+};
+
+Result play(int matches, bool v2a, bool v2b) {
+    Result r = {};
+    Badge &a = badges[0], &b = badges[1];
+    for (int m = 0; m < matches; m++) {
+        for (Badge *x = badges; x < badges + 2; x++) {
+            GameMachine *game = x->game;
+            const char *name = x->name;
+            uint32_t id = x->id;
+            *x = Badge();
+            x->game = game;
+            x->name = name;
+            x->id = id;
+        }
+        a.caps = v2a ? MESSAGE_CAPS : (MESSAGE_CAPS & ~MESSAGE_CAPS_V2);
+        b.caps = v2b ? MESSAGE_CAPS : (MESSAGE_CAPS & ~MESSAGE_CAPS_V2);
+        // both rolled, B got A's ATTACK
+        a.msg.type = MESSAGE_TYPE_ATTACK;
+        a.msg.button = random(4);
+        a.msg.strength = 1 + random(6);
+        b.msg.type = MESSAGE_TYPE_COUNTER_ATTACK;
+        b.msg.button = random(4);
+        b.msg.strength = 1 + random(6);
+        b.peerCaps = a.caps;
+        b.peerMsg = a.msg;
+        b.gameStateP2 = GAMEPLAY_STATE_ATTACK;
+
+        // A's ATTACK went out a while ago, it waits out the row's timeout like the ATTACK row
+        self = &a;
+        other = &b;
+        a.game->enter(GAMEPLAY_STATE_ATTACK_ACK);
+        self = &b;
+        other = &a;
+        createMessage(b.buf, MESSAGE_TYPE_COUNTER_ATTACK);
+        b.game->enter((b.peerCaps & MESSAGE_CAPS_V2) ? GAMEPLAY_STATE_COUNTER_RESULT : GAMEPLAY_STATE_COUNTER_ATTACK);
+
+        unsigned long start = millis();
+        while (millis() - start < MATCH_MAX_MS && !(a.shownAt && b.shownAt) && !a.failed && !b.failed) {
+            loop(&a);
+            loop(&b);
+            delay(1);
+        }
+        if (a.shownAt && b.shownAt && !a.failed && !b.failed) {
+            r.done++;
+            r.counter_ms += b.shownAt - start;
+            r.attacker_ms += a.shownAt - start;
+            r.frames += a.frames + b.frames;
+        }
+        // the next match is with someone else, later
+        a.game->enter(GAMEPLAY_STATE_IDLE);
+        b.game->enter(GAMEPLAY_STATE_IDLE);
+        delay(GAME_DUPLICATE_MS);
+    }
+    return r;
+}
+
+int main(int argc, char **argv) {
+    int matches = 1000;
+    int loss = -1;
+    bool rtt = false;
+    bool logging = false;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            matches = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-l") && i + 1 < argc) {
+            loss = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-r")) {
+            rtt = true;
+        } else if (!strcmp(argv[i], "-g")) {
+            logging = true;
+        }
+    }
+    srand(1);
+    host_clock_us = 1000000;
+    GameMachine gameA(gameTable, GAMEPLAY_STATE_COUNT, badges[0].buf, &irsend, sendFrame, processMessage);
+    GameMachine gameB(gameTable, GAMEPLAY_STATE_COUNT, badges[1].buf, &irsend, sendFrame, processMessage);
+    badges[0].name = "A";
+    badges[0].id = 0x1001;
+    badges[0].game = &gameA;
+    badges[1].name = "B";
+    badges[1].id = 0x2002;
+    badges[1].game = &gameB;
+    if (logging) {
+        gameA.setLog(&Serial);
+        gameB.setLog(&Serial);
+    }
+
+    static const struct { const char *name; bool v2a, v2b; } pairings[] = {
+        { "-/-", false, false }, { "V2/V2", true, true }, { "V2/-", true, false }, { "-/V2", false, true },
+    };
+    printf("loss  attacker/counter  done       counter_ms  attacker_ms  frames\n");
+    for (int l = (loss < 0) ? 0 : loss; l <= ((loss < 0) ? 30 : loss); l += 10) {
+        lossPercent = l;
+        for (unsigned p = 0; p < sizeof(pairings) / sizeof(pairings[0]); p++) {
+            Result r = play(matches, pairings[p].v2a, pairings[p].v2b);
+            int done = r.done ? r.done : 1;
+            printf("%3d%%  %-16s  %4d/%-4d  %10lu  %11lu  %6.2f\n", l, pairings[p].name, r.done, matches,
+                    r.counter_ms / done, r.attacker_ms / done, (double)r.frames / done);
+        }
+    }
+    if (rtt) {
+        printf("A:\n");
+        gameA.printRtt(&Serial);
+        printf("B:\n");
+        gameB.printRtt(&Serial);
+    }
+    return 0;
+}
@@ -0,0 +1,82 @@
+/*
+ * IRremoteLearn: IRtraceReader - turns IRrecv::setTrace() records into a replay corpus
+ *
+ * Reads the binary records from a file, or straight from the badge's USB serial port
+ * (stty -F /dev/ttyACM0 raw first), skipping the log text around them. Every frame is
+ * written as edges in the IRReplayEdgeSource format, preceded by a comment with its
+ * sequence number and decode outcome, so a booth session can be replayed by IRhostBench.
+ *
+ * IRtraceReader input|- corpus.txt
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "IRtrace.h"
+
+#define RAWLEN_MAX 4096
+
+static uint16_t rawbuf[RAWLEN_MAX];
+static uint8_t payload[IR_TRACE_MAX(RAWLEN_MAX)];
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s input|- corpus.txt\n", argv[0]);
+        return 1;
+    }
+    FILE *in = strcmp(argv[1], "-") ? fopen(argv[1], "rb") : stdin;
+    FILE *out = fopen(argv[2], "w");
+    if (!in || !out) {
+        perror("open");
+        return 1;
+    }
+    setvbuf(out, NULL, _IOLBF, 0); // corpus stays usable if the session is cut short
+
+    unsigned long records = 0, bad = 0;
+    unsigned long offset = 0, last = 0; // keep the corpus clock monotonic across badge reboots
+    int c, prev = -1;
+    while ((c = fgetc(in)) != EOF) {
+        if (prev != IR_TRACE_SYNC0 || c != IR_TRACE_SYNC1) {
+            prev = c;
+            continue;
+        }
+        prev = -1;
+        uint8_t header[3];
+        if (fread(header, 1, 3, in) != 3) {
+            break;
+        }
+        size_t len = header[1] | (header[2] << 8);
+        if (header[0] != IR_TRACE_VERSION || len > sizeof(payload) - 1) {
+            bad++;
+            continue;
+        }
+        if (fread(payload, 1, len + 1, in) != len + 1) {
+            break;
+        }
+        uint8_t check = 0;
+        for (size_t i = 0; i < len; i++) {
+            check ^= payload[i];
+        }
+        irtrace_t trace;
+        if (check != payload[len] || !ir_trace_decode(payload, len, &trace, rawbuf, RAWLEN_MAX)) {
+            bad++;
+            continue;
+        }
+
+        unsigned long t = trace.time_us + offset;
+        if (records && t <= last) {
+            offset += last + 100000 - t;
+            t = last + 100000;
+        }
+        fprintf(out, "# seq %lu rawlen %u result %u type %d\n", (unsigned long)trace.seq, trace.rawlen,
+                trace.result, trace.decode_type);
+        for (int i = 0; i < trace.rawlen; i++) {
+            fprintf(out, "%lu %d\n", t, i % 2); // MARK edges are level 0, SPACE edges level 1
+            t += rawbuf[i];
+        }
+        fprintf(out, "%lu 1\n", t);
+        last = t;
+        records++;
+    }
+    fprintf(stderr, "%lu records, %lu bad\n", records, bad);
+    return 0;
+}
@@ -35,6 +35,40 @@
 
 // #define DEBUG_IR
 
+// Raw mark/space durations are stored as 16-bit microsecond counts. Anything
+// longer than IR_RAW_MAX saturates, which only ever happens for idle gaps.
+// Define IR_RAW_LONG_GAPS to keep long gaps instead: entries with IR_RAW_LONG_FLAG
+// set count in units of (1 << IR_RAW_LONG_SHIFT) us, which leaves 1 us resolution
+// up to IR_RAW_SHORT_MAX. Use ir_raw_us() to read either form back.
+// #define IR_RAW_LONG_GAPS
+
+typedef uint16_t irraw_t;
+#define IR_RAW_MAX 0xFFFF
+#define IR_RAW_SHORT_MAX 0x7FFF
+#define IR_RAW_LONG_FLAG 0x8000
+#define IR_RAW_LONG_SHIFT 6
+
+static inline unsigned long ir_raw_us(irraw_t raw) {
+#ifdef IR_RAW_LONG_GAPS
+  if (raw & IR_RAW_LONG_FLAG) {
+    return (unsigned long)(raw & IR_RAW_SHORT_MAX) << IR_RAW_LONG_SHIFT;
+  }
+#endif
+  return raw;
+}
+
+#define RX_BUF_MAX 100 // Length of rx buffer for decoded bytes
+
+// Link quality of one BYTES frame, see decode_results::quality. Deviations are measured
+// on what tells the symbols apart: the space for IR_PHY_NEC, mark to mark for IR_PHY_PPM4.
+typedef struct {
+  uint16_t symbols;               // MARK/SPACE pairs after the header
+  uint16_t mean_dev_us;           // Mean distance of a pair from its symbol's ideal timing
+  uint16_t max_dev_us;            // Largest distance
+  uint16_t marginal;              // Pairs more than half way to a decision threshold
+  int16_t header_margin_us;       // Distance of the header mark or space to its match window edge, whichever is closer
+} irquality_t;
+
 // Results returned from the decoder
 class decode_results {
 public:
@@ -42,12 +76,76 @@ public:
   unsigned int address;           // This is only used for decoding Panasonic data
   unsigned long value;            // Decoded value
   int bits;                       // Number of bits in decoded value
-  volatile unsigned long *rawbuf; // Raw intervals in .5 us ticks
+  volatile irraw_t *rawbuf;       // Raw intervals in us ticks, see ir_raw_us()
   unsigned long rawlen;           // Number of records in rawbuf.
-  uint8_t rx_data[100];           // Receive data buffer for longer protocols
+  unsigned long seq;              // Capture sequence number, changes with every new frame
+  uint8_t rx_data[RX_BUF_MAX];    // Receive data buffer for longer protocols
   uint16_t rx_len;                // Receive data buffer length for longer protocols
+  uint8_t phy;                    // IR_PHY_NEC or IR_PHY_PPM4, for BYTES frames
+  uint8_t format;                 // IR_FMT_* flags, for BYTES frames
+  int stretch_us;                 // Mark stretch measured on the header, for BYTES frames
+  long skew_ppm;                  // Clock skew measured on the header, for BYTES frames
+  irquality_t quality;            // Timing margins, for BYTES frames
 };
 
+// BYTES frame modulations, told apart by the header space
+#define IR_PHY_NEC  0   // Pulse distance, 1 bit per mark, ~800 bit/s
+#define IR_PHY_PPM4 1   // 4-ary pulse position, 2 bits per mark, ~1900 bit/s
+
+// BYTES frame format flags, 0 is the plain frame every receiver decodes
+#define IR_FMT_FEC  0x01 // Hamming(8,4) coded DATA and CRC, one flipped bit per code byte is fixed
+#define IR_FMT_CRC16 0x02 // CRC-16/CCITT instead of the XOR crc8() byte, catches what XOR misses
+
+// Receiver counters, see IRrecv::stats()
+typedef struct {
+  unsigned long frames;           // Frames captured
+  unsigned long frames_dropped;   // Frames dropped because the capture queue was full
+  unsigned long edges_dropped;    // Edges dropped because decode() fell behind the edge ring
+  unsigned long glitches;         // Marks shorter than the minimum pulse width that were rejected
+  unsigned long headers_rejected; // Frames dropped for not starting with a header mark
+  unsigned long fec_corrected;    // Bits fixed by the FEC in IR_FMT_FEC frames that decoded
+  unsigned long echoes;           // Frames dropped as the echo of our own async sends
+  unsigned long calibrated;       // BYTES frames that decoded, averaged over below
+  long stretch_us_avg;            // Mark stretch, receiver lag less the TX LED's
+  long skew_ppm_avg;              // Clock skew, how much longer durations came in than sent
+  unsigned long crc_failures;     // BYTES frames with all their bytes in but a bad CRC
+  unsigned long decode_errors;    // BYTES frames cut short by a pair out of spec or a bad LENGTH
+} irrecv_stats_t;
+
+// Per peer counters, see IRrecv::setPeerId(). Quality figures are rolling averages
+// over the frames decoded, each new frame weighs 1/8.
+typedef struct {
+  uint32_t id;                    // Sender ID, as the frames carry it
+  unsigned long frames;           // Frames decoded
+  unsigned long crc_failures;     // Frames with a bad CRC
+  unsigned long decode_errors;    // Frames cut short after the sender ID was in
+  uint16_t mean_dev_us;           // irquality_t::mean_dev_us
+  uint16_t max_dev_us;            // irquality_t::max_dev_us
+  uint16_t marginal_permille;     // irquality_t::marginal per symbol
+  int16_t header_margin_us;       // irquality_t::header_margin_us
+  unsigned long last_ms;          // millis() of the last frame, good or bad
+} irpeer_stats_t;
+
+#define IR_PEER_TABLE 8 // Peers tracked, the one heard from longest ago makes room for a new one
+
+// Transmitter counters, see IRsend::stats()
+typedef struct {
+  unsigned long frames;           // Frames sent by sendSymbolsAsync() and sendBytesAsync()
+  unsigned long deferred;         // Frames that found the channel busy and backed off
+  unsigned long backoffs;         // Random backoff waits, all frames
+  unsigned long forced;           // Frames sent on a busy channel after IR_CSMA_MAX_TRIES backoffs
+  unsigned long backoff_us;       // Time spent backing off
+} irsend_stats_t;
+
+// Listen before talk, see IRsend::setCarrierSense()
+#define IR_CSMA_QUIET_US  5000  // Line quiet this long is free, longer than any gap inside a BYTES frame
+#define IR_CSMA_SLOT_US   10000 // First backoff window, doubles every time the line is still busy
+#define IR_CSMA_MAX_TRIES 5     // Backoffs before a frame goes out anyway, 310ms at the most
+
+// End of frame detection, see IRrecv::setEndOfFrame()
+#define IR_EOF_WINDOW 0   // Close a fixed capture window after the first MARK
+#define IR_EOF_IDLE   1   // Close once no edge came for the idle gap, polled by decode()
+
 // Values for decode_type
 #define NEC 1
 #define SONY 2
@@ -66,6 +164,12 @@ public:
 // Decoded value for NEC when a repeat code is received
 #define REPEAT 0xffffffff
 
+class IREdgeSource;
+struct irsymbols_t;
+
+// called when a sendBytesAsync() frame is out, from the transmit thread
+typedef void (*irsend_done_t)(void);
+
 // main class for receiving IR
 class IRrecv
 {
@@ -76,7 +180,26 @@ public:
   void enableIRIn();
   void disableIRIn();
   void resume();
+  void stats(irrecv_stats_t *stats);
+  void setGlitchFilter(unsigned long min_pulse_us, bool require_header);
+  void setEndOfFrame(uint8_t mode, unsigned long idle_gap_us=5000);
+  void setEdgeSource(IREdgeSource *source);
+  void setTrace(Print *out);
+  bool idle(unsigned long quiet_us);
+  void setEchoSuppression(bool on);
+  void setPeerId(int offset);
+  bool peerStats(uint32_t id, irpeer_stats_t *stats);
+  void dumpPeers(Print *out);
 private:
+  IREdgeSource *source;
+  Print *trace_out;
+  unsigned long trace_seq;
+  int peer_offset;
+  unsigned long link_seq;
+  irpeer_stats_t peers[IR_PEER_TABLE];
+  irpeer_stats_t *findPeer(uint32_t id, bool add);
+  void countLink(decode_results *results, uint8_t outcome, int data_len);
+  int decodeFrame(decode_results *results);
   // These are called by decode
   int getRClevel(decode_results *results, int *offset, int *used, int t1);
   long decodeNEC(decode_results *results);
@@ -90,6 +213,7 @@ private:
   long decodeHash(decode_results *results);
   long decodeDisney(decode_results *results);
   long decodeBytes(decode_results *results);
+  long decodeStream(decode_results *results);
   int compare(unsigned int oldval, unsigned int newval);
 
 };
@@ -111,6 +235,14 @@ public:
   void sendPanasonic(unsigned int address, unsigned long data);
   void sendJVC(unsigned long data, int nbits, int repeat); // *Note instead of sending the REPEAT constant if you want the JVC repeat signal sent, send the original code value and change the repeat argument from 0 to 1. JVC protocol repeats by skipping the header NOT by sending a separate code value like NEC does.
   void sendBytes(uint8_t data[], int len);
+  bool sendBytesAsync(uint8_t data[], int len, irsend_done_t done=NULL); // returns at once, but loop() gets ~2% of an IR_PHY_NEC frame
+  const irsymbols_t *encodeBytes(uint8_t data[], int len, uint8_t phy=IR_PHY_NEC, uint8_t format=0);
+  bool release(const irsymbols_t *symbols);
+  void sendSymbols(const irsymbols_t *symbols);
+  bool sendSymbolsAsync(const irsymbols_t *symbols, irsend_done_t done=NULL);
+  bool busy();
+  void setCarrierSense(IRrecv *receiver, unsigned long quiet_us=IR_CSMA_QUIET_US, unsigned long slot_us=IR_CSMA_SLOT_US);
+  void stats(irsend_stats_t *stats);
   // private:
   void enableIROut(int khz);
   void mark(int usec);
@@ -122,9 +254,24 @@ public:
 #define USECPERTICK 1 // microseconds per clock interrupt tick (we are capturing times in microseconds to 1:1)
 #define RAWBUF 512 // Length of raw rx duration buffer
 #define TX_BUF_MAX 32 // Length of tx buffer
+#define IR_TX_SCHEDULE (2 + 16 * (2 + 2 * (TX_BUF_MAX + 2)) + 1) // BYTES frame durations: header, LENGTH/FORMAT/coded DATA/CRC-16 bits and the trailing mark
+#define IR_EDGE_RING 1024 // Length of the ISR edge ring, must be a power of 2
+#define IR_FRAME_QUEUE 4 // Captured frames kept for decode(), including the one being filled, must be a power of 2
+#define IR_SYMBOL_POOL 2 // Frames IRsend::encodeBytes() can hand out at once
+// Together these take about 16 KB of static RAM, see RAM in the README
 
 // Marks tend to be 100us too long, and spaces 100us too short
-// when received due to sensor lag.
+// when received due to sensor lag. BYTES frames measure it on
+// their header instead, see decode_results::stretch_us.
 #define MARK_EXCESS 1
 
+// A BYTES frame encoded by IRsend::encodeBytes(), replayed as is by every send
+struct irsymbols_t {
+  uint16_t durations[IR_TX_SCHEDULE]; // MARK and SPACE durations in micro seconds, MARK first
+  uint16_t count;                     // durations in use
+  bool in_use;                        // taken from the pool until IRsend::release()
+};
+
+#include "IREdgeSource.h"
+
 #endif // IRremoteLearn_h
@@ -0,0 +1,88 @@
+/*
+ * IRremoteLearn
+ *
+ * Binary trace records for raw IR captures, format in IRtrace.h
+ */
+
+#include "IRtrace.h"
+
+static size_t put_u16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    return 2;
+}
+
+static size_t put_u32(uint8_t *p, uint32_t v) {
+    put_u16(p, v);
+    put_u16(p + 2, v >> 16);
+    return 4;
+}
+
+static uint32_t get_u16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return get_u16(p) | (get_u16(p + 2) << 16);
+}
+
+size_t ir_trace_encode(uint8_t *buf, size_t size, const irtrace_t *trace, const volatile uint16_t *rawbuf) {
+    if (size < (size_t)IR_TRACE_MAX(trace->rawlen)) {
+        return 0;
+    }
+    uint8_t *payload = buf + IR_TRACE_HEADER;
+    size_t n = 0;
+    n += put_u32(payload + n, trace->time_us);
+    n += put_u32(payload + n, trace->seq);
+    n += put_u16(payload + n, trace->rawlen);
+    payload[n++] = trace->result;
+    payload[n++] = (uint8_t)trace->decode_type;
+    for (int i = 0; i < trace->rawlen; i++) {
+        int32_t delta = (int32_t)rawbuf[i] - ((i >= 2) ? (int32_t)rawbuf[i - 2] : 0);
+        uint32_t zigzag = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+        do {
+            payload[n++] = (zigzag & 0x7F) | ((zigzag > 0x7F) ? 0x80 : 0);
+            zigzag >>= 7;
+        } while (zigzag);
+    }
+
+    buf[0] = IR_TRACE_SYNC0;
+    buf[1] = IR_TRACE_SYNC1;
+    buf[2] = IR_TRACE_VERSION;
+    put_u16(buf + 3, n);
+    uint8_t check = 0;
+    for (size_t i = 0; i < n; i++) {
+        check ^= payload[i];
+    }
+    payload[n] = check;
+    return IR_TRACE_HEADER + n + 1;
+}
+
+bool ir_trace_decode(const uint8_t *payload, size_t len, irtrace_t *trace, uint16_t *rawbuf, size_t max) {
+    if (len < IR_TRACE_FIXED) {
+        return false;
+    }
+    trace->time_us = get_u32(payload);
+    trace->seq = get_u32(payload + 4);
+    trace->rawlen = get_u16(payload + 8);
+    trace->result = payload[10];
+    trace->decode_type = (int8_t)payload[11];
+    if (trace->rawlen > max) {
+        return false;
+    }
+    size_t n = IR_TRACE_FIXED;
+    for (int i = 0; i < trace->rawlen; i++) {
+        uint32_t zigzag = 0;
+        int shift = 0;
+        do {
+            if (n >= len || shift > 28) {
+                return false;
+            }
+            zigzag |= (uint32_t)(payload[n] & 0x7F) << shift;
+            shift += 7;
+        } while (payload[n++] & 0x80);
+        int32_t delta = (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+        rawbuf[i] = delta + ((i >= 2) ? rawbuf[i - 2] : 0);
+    }
+    return n == len;
+}
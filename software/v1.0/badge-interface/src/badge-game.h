@@ -0,0 +1,162 @@
+/*
+ * Particle Bay Area Maker Faire 2023 Badge - game protocol state machine
+ *
+ * Shared by the badge and the badge interface, keep both copies the same.
+ *
+ * Each firmware describes its GAMEPLAY_STATE_* in a table, one row per state in the
+ * order of their numbers, and GameMachine runs it: what the state keeps sending and
+ * how often, how long it waits for the other badge after that, and what to do on
+ * entering it, on every send, after the last one, on a frame and on a timeout.
+ *
+ * A state that names the reply it waits for resends until it comes in. It keeps a
+ * smoothed round trip time (SRTT) and its variation (RTTVAR) from send to reply, the
+ * way TCP does, and resends after SRTT + 4 * RTTVAR, doubled each time and jittered
+ * so two badges don't keep colliding. As many resends as fit before its timeout,
+ * counted from the first send. Only replies that follow a single send are timed, a
+ * resent exchange keeps the backed off interval for the next one. A send that didn't
+ * go out isn't counted, it's tried again GAME_RETRANSMIT_MS later.
+ *
+ * A frame that repeats the last one handled, of a message some row resends until its
+ * reply comes in, is the other badge resending it: it isn't handled again, and if
+ * handling it made us answer, the answer goes out again. Messages sent once, like an
+ * ATTACK, are always handled, so pressing again starts a new match.
+ */
+
+#ifndef BADGE_GAME_H
+#define BADGE_GAME_H
+
+#include "Particle.h"
+#include "IRremoteLearn.h"
+#include "badge-message.h"
+
+#define GAME_NO_MESSAGE         (0xff)  // GameState::message of a state that sends nothing
+#define GAME_RETRANSMIT_MS      (500)   // between two sends of the same message, without a reply to time
+#define GAME_RTO_MIN_MS         (250)   // resend interval bounds, before backoff and jitter
+#define GAME_RTO_MAX_MS         (4000)
+#define GAME_DUPLICATE_MS       (10000) // a repeat this soon after the frame is a resend, > timeout_ms of the rows that resend
+#define GAME_MAX_STATES         (16)
+
+#define GAME_BACK_TO_BACK       (0x01)  // send as soon as the previous frame is out
+
+typedef void (*GameHandler)();
+typedef bool (*GameSender)(uint8_t *buf, int len); // false if the frame didn't go out
+
+struct GameState {
+    uint8_t state;              // GAMEPLAY_STATE_* this row is for, its index in the table
+    const char *name;           // for the log
+    uint8_t message;            // MESSAGE_TYPE_* it keeps sending from the TX buffer, or GAME_NO_MESSAGE
+    uint8_t reply;              // MESSAGE_TYPE_* the other badge answers it with right away, or GAME_NO_MESSAGE
+    uint8_t sends;              // times it sends it, at most when it waits for a reply
+    uint8_t flags;              // GAME_*
+    uint16_t rto_ms;            // resend interval until a round trip was timed, when it waits for a reply
+    uint32_t timeout_ms;        // after the first send when it waits for a reply, else after the last
+                                // send or on entering a state that sends nothing. 0 never
+    GameHandler onEnter;        // the TX buffer is filled before entering
+    GameHandler onSend;         // after every send
+    GameHandler onSent;         // after the last send, instead of waiting for the timeout
+    GameHandler onFrame;        // a message came in, nullptr for the machine's default
+    GameHandler onTimeout;
+};
+
+// True if a table is safe to dispatch on, checked at compile time:
+// static_assert(gameTableValid(table, count), "...");
+constexpr bool gameTableValid(const GameState *table, int states) {
+    if (states > GAME_MAX_STATES) {
+        return false;
+    }
+    for (int i = 0; i < states; i++) {
+        const GameState &row = table[i];
+        if (row.state != i) {
+            return false; // dispatch indexes the table by state
+        }
+        if (row.message != GAME_NO_MESSAGE) {
+            if (!messageLength(row.message) || !row.sends) {
+                return false;
+            }
+            if (!row.timeout_ms && !row.onSent) {
+                return false; // would sit there forever after the last send
+            }
+            if (row.reply != GAME_NO_MESSAGE && (!messageLength(row.reply) || !row.rto_ms || !row.timeout_ms ||
+                    (row.flags & GAME_BACK_TO_BACK))) {
+                return false;
+            }
+        } else if (row.reply != GAME_NO_MESSAGE || row.sends || (row.flags & GAME_BACK_TO_BACK) || row.onSend ||
+                row.onSent) {
+            return false;
+        }
+        if (row.timeout_ms && !row.onTimeout) {
+            return false;
+        }
+    }
+    return true;
+}
+
+class GameMachine {
+public:
+    GameMachine(const GameState *table, int states, uint8_t *buf, IRsend *irsend, GameSender send,
+            GameHandler onFrame);
+
+    // Prints sends and timeouts when set
+    void setLog(Print *log) {
+        this->log = log;
+    }
+
+    // Switch state, fill the TX buffer first for a state that sends
+    void enter(int state);
+
+    // Send the current state's message again from the top and stop its timeout
+    void resend();
+
+    // Hand a message parse() accepted to the current state
+    void frame(const decode_results *results);
+
+    // Call every loop(): sends when it's time and times out
+    void poll();
+
+    int state() const {
+        return current;
+    }
+
+    // Round trip times of the states that wait for a reply
+    void printRtt(Print *out);
+
+private:
+    const GameState *table;
+    int states;
+    uint8_t *buf;
+    IRsend *irsend;
+    GameSender send;
+    GameHandler onFrame;
+    Print *log;
+
+    int current;
+    int sends;                  // left to send
+    int sent;                   // sent since entering, 0 once the reply came in
+    uint32_t startRetransmit;
+    uint32_t retransmitDelay;
+    uint32_t startTimeout;      // 0 while not waiting
+
+    struct GameRtt {
+        uint32_t srtt_ms;       // 0 until timed
+        uint32_t rttvar_ms;
+        uint32_t rto_ms;        // 0 until timed or backed off, the row's rto_ms then
+        uint32_t samples;
+        uint32_t resent;        // exchanges that needed more than one send
+    } rtt[GAME_MAX_STATES];
+
+    uint32_t resentTypes;       // bit per MESSAGE_TYPE_* some row resends until its reply
+    uint8_t lastFrame[MESSAGE_MAX_LEN]; // DATA of the last frame handled
+    int lastFrameLen;
+    uint32_t lastFrameMs;
+    uint8_t answer[MESSAGE_MAX_LEN];    // what we sent because of it
+    int answerLen;
+    bool answerPending;
+    uint32_t duplicates;
+
+    uint32_t rto(int state) const;
+    int plan(int state) const;
+    void timeReply();
+    bool duplicate(const decode_results *results);
+};
+
+#endif // BADGE_GAME_H
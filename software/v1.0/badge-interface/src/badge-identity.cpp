@@ -0,0 +1,91 @@
+/*
+ * Particle Bay Area Maker Faire 2023 Badge - identity
+ *
+ * Shared by the badge and the badge interface, keep both copies the same.
+ */
+
+#include "badge-identity.h"
+
+uint32_t badgeId = 0;
+
+void identityBegin() {
+    // The only String we need, once
+    String idStr = System.deviceID();
+    badgeId = strtoul(idStr.c_str() + idStr.length() - 8, NULL, 16);
+}
+
+#if ENABLE_ALLOC_AUDIT
+
+struct AllocAudit {
+    uint32_t windows;   // times the path ran
+    uint32_t allocs;    // operator new calls while it ran
+    uint32_t leaks;     // times it ended with less free heap than it started with
+    uint32_t held;      // most heap it kept, bytes
+};
+
+static AllocAudit allocAudit[ALLOC_AUDIT_PATHS] = {};
+static volatile int allocAuditPath = -1;
+static uint32_t allocAuditFree = 0;
+
+void allocAuditBegin(int path) {
+    allocAuditFree = System.freeMemory();
+    allocAudit[path].windows++;
+    allocAuditPath = path;
+}
+
+void allocAuditEnd() {
+    int path = allocAuditPath;
+    if (path < 0) {
+        return;
+    }
+    allocAuditPath = -1;
+    uint32_t free = System.freeMemory();
+    if (free < allocAuditFree) {
+        allocAudit[path].leaks++;
+        if (allocAuditFree - free > allocAudit[path].held) {
+            allocAudit[path].held = allocAuditFree - free;
+        }
+    }
+}
+
+void allocAuditPrint(Print *out) {
+    static const char *names[ALLOC_AUDIT_PATHS] = { "RX", "TX" };
+    for (int i = 0; i < ALLOC_AUDIT_PATHS; i++) {
+        out->printlnf("ALLOC %s windows:%lu allocs:%lu leaks:%lu held:%luB", names[i], allocAudit[i].windows,
+                allocAudit[i].allocs, allocAudit[i].leaks, allocAudit[i].held);
+    }
+}
+
+static void *allocAuditNew(size_t size) {
+    int path = allocAuditPath;
+    if (path >= 0) {
+        allocAudit[path].allocs++;
+    }
+    return malloc(size);
+}
+
+void *operator new(size_t size) {
+    return allocAuditNew(size);
+}
+
+void *operator new[](size_t size) {
+    return allocAuditNew(size);
+}
+
+void operator delete(void *p) {
+    free(p);
+}
+
+void operator delete[](void *p) {
+    free(p);
+}
+
+void operator delete(void *p, size_t size) {
+    free(p);
+}
+
+void operator delete[](void *p, size_t size) {
+    free(p);
+}
+
+#endif // ENABLE_ALLOC_AUDIT
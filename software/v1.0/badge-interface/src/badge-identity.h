@@ -0,0 +1,43 @@
+/*
+ * Particle Bay Area Maker Faire 2023 Badge - identity
+ *
+ * Shared by the badge and the badge interface, keep both copies the same.
+ *
+ * The 32-bit short ID badges tell each other apart by is the last 8 hex digits of
+ * the device ID. It is worked out once at boot, reading it after that costs nothing.
+ */
+
+#ifndef BADGE_IDENTITY_H
+#define BADGE_IDENTITY_H
+
+#include "Particle.h"
+
+// Count the heap allocations made between an IR frame coming in and the game state
+// update it causes, and while a frame goes out. There should be none.
+#ifndef ENABLE_ALLOC_AUDIT
+#define ENABLE_ALLOC_AUDIT (0)
+#endif
+
+// Our short ID, valid once identityBegin() ran
+extern uint32_t badgeId;
+
+// Call first thing in setup()
+void identityBegin();
+
+#define ALLOC_AUDIT_RX      (0) // irrecv.decode() through the game state update
+#define ALLOC_AUDIT_TX      (1) // building a message and handing the frame to irsend
+#define ALLOC_AUDIT_PATHS   (2)
+
+#if ENABLE_ALLOC_AUDIT
+// Counts operator new calls, and heap that is still held when the window closes,
+// which catches String and other malloc() users too
+void allocAuditBegin(int path);
+void allocAuditEnd();
+void allocAuditPrint(Print *out);
+#else
+inline void allocAuditBegin(int path) {}
+inline void allocAuditEnd() {}
+inline void allocAuditPrint(Print *out) {}
+#endif // ENABLE_ALLOC_AUDIT
+
+#endif // BADGE_IDENTITY_H
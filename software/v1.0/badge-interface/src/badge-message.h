@@ -0,0 +1,241 @@
+/*
+ * Particle Bay Area Maker Faire 2023 Badge - IR message wire format
+ *
+ * Shared by the badge and the badge interface, keep both copies the same.
+ *
+ * ATTACK (P1): HEADER:P1_ID:[MSG_TYP:MSG_BTN:MSG_STR]:P1_SCORE:CRC
+ *              1:4:1:2 (8)
+ *
+ * COUNTER(P2): HEADER:P2_ID:[MSG_TYP:MSG_BTN:MSG_STR]:P2_SCORE:P1_ID:[MSG_TYP:MSG_BTN:MSG_STR]:CRC
+ *              1:4:1:2:4:1 (13)
+ *
+ * RESULT (P1): HEADER:P1_ID:[MSG_TYP:MSG_BTN:MSG_STR]:P1_P2_ID:CRC
+ *              1:4:1:4 (10)
+ *
+ * SCORE_ACK(P2): HEADER:P1_ID:[MSG_TYP:MSG_BTN:MSG_STR]:P1_SCORE:CRC
+ *                1:4:1:2 (8)
+ *
+ * The HEADER and CRC are the IR frame's LENGTH and CRC bytes, the message is the DATA
+ * in between. In decode_results::rx_data it starts after the LENGTH byte.
+ */
+
+#ifndef BADGE_MESSAGE_H
+#define BADGE_MESSAGE_H
+
+#include <type_traits>
+#include "Particle.h"
+#include "IRremoteLearn.h"
+
+#define MAGIC_HEADER_BYTE                   (0xA2)
+#define MESSAGE_TYPE_MASK                   (0xE0)
+#define MESSAGE_BUTTON_MASK                 (0x18)
+#define MESSAGE_STRENGTH_MASK               (0x07)
+#define MESSAGE_TYPE_OFFSET                 (5)
+#define MESSAGE_BUTTON_OFFSET               (3)
+#define MESSAGE_STRENGTH_OFFSET             (0)
+
+#define MESSAGE_TYPE_ATTACK                 (0)
+#define MESSAGE_TYPE_ATTACK_ACK             (1)
+#define MESSAGE_TYPE_COUNTER_ATTACK         (2)
+#define MESSAGE_TYPE_COUNTER_ATTACK_ACK     (3)
+#define MESSAGE_TYPE_RESULT                 (4)
+#define MESSAGE_TYPE_RESULT_ACK             (5)
+#define MESSAGE_TYPE_SCORE_ACK              (6)
+
+// Last byte of every message. v1 badges send one byte less and the v1 interface
+// sends 0 there, neither reads it, so it only ever adds capabilities.
+#define MESSAGE_CAPS_PPM4                   (0x01) // sender decodes IR_PHY_PPM4 frames
+#define MESSAGE_CAPS_FEC                    (0x02) // sender decodes IR_FMT_FEC frames
+#define MESSAGE_CAPS_CRC16                  (0x04) // sender decodes IR_FMT_CRC16 frames
+#define MESSAGE_CAPS_V2                     (0x08) // sender settles a match on COUNTER_ATTACK, see below
+// Badges decode IR_PHY_PPM4 but don't ask for it: its 300us symbol 0 space is only 100us
+// over the capture's mark timeout, and receiver lag stretching marks by 75us or more merges
+// it into the mark (IRhostBench -l 75 -p -c -k). NEC frames pass the same bench intact.
+#define MESSAGE_CAPS                        (MESSAGE_CAPS_FEC | MESSAGE_CAPS_CRC16 | MESSAGE_CAPS_V2)
+
+// A v1 match takes ATTACK, COUNTER_ATTACK, RESULT and RESULT_ACK. The winner follows
+// from the two strengths, and COUNTER_ATTACK carries both: the countering badge's own
+// and the attack it answers. So when both badges send MESSAGE_CAPS_V2, the attacker
+// answers COUNTER_ATTACK with RESULT_ACK right away and skips RESULT. The countering
+// badge only expects that when the ATTACK had the bit, the attacker only sends it when
+// the COUNTER_ATTACK had it, anyone else gets the v1 exchange. The interface keeps score
+// and plays v1 matches only, so it leaves the bit out of its caps.
+
+struct IRMessage {
+                                   // MSB[AAA:BB:CCC]LSB
+    uint8_t strength:3;            //      |  |  \----- C = Strength (0-6)
+    uint8_t button:2;              //      |  \-------- B = Button   (0-3)
+    uint8_t type:3;                //      \----------- A = Type     (0-6)
+};
+
+// How a field's value is laid out in its bytes
+struct WireId {                    // 32-bit device ID, as memcpy() leaves it on the badge
+    typedef uint32_t value_type;
+    static constexpr uint8_t size = 4;
+    static value_type read(const uint8_t *p) {
+        value_type v;
+        memcpy(&v, p, size);
+        return v;
+    }
+    static void write(uint8_t *p, value_type v) {
+        memcpy(p, &v, size);
+    }
+};
+
+struct WireScore {                 // 16-bit score, MSB first
+    typedef uint16_t value_type;
+    static constexpr uint8_t size = 2;
+    static value_type read(const uint8_t *p) {
+        return (p[0] << 8) | p[1];
+    }
+    static void write(uint8_t *p, value_type v) {
+        p[0] = v >> 8;
+        p[1] = v & 0xff;
+    }
+};
+
+struct WireMessage {               // IRMessage, [type:button:strength] in one byte
+    typedef IRMessage value_type;
+    static constexpr uint8_t size = 1;
+    static value_type read(const uint8_t *p) {
+        IRMessage msg;
+        msg.type = (p[0] & MESSAGE_TYPE_MASK) >> MESSAGE_TYPE_OFFSET;
+        msg.button = (p[0] & MESSAGE_BUTTON_MASK) >> MESSAGE_BUTTON_OFFSET;
+        msg.strength = (p[0] & MESSAGE_STRENGTH_MASK) >> MESSAGE_STRENGTH_OFFSET;
+        return msg;
+    }
+    static void write(uint8_t *p, value_type msg) {
+        p[0] = (msg.type << MESSAGE_TYPE_OFFSET) | (msg.button << MESSAGE_BUTTON_OFFSET) |
+                (msg.strength << MESSAGE_STRENGTH_OFFSET);
+    }
+};
+
+// A field: where it starts in the message and how it is laid out
+template <uint8_t Offset, typename Wire>
+struct MessageField {
+    typedef typename Wire::value_type value_type;
+    static constexpr uint8_t offset = Offset;
+    static constexpr uint8_t end = Offset + Wire::size;
+    static value_type read(const uint8_t *data) {
+        return Wire::read(data + Offset);
+    }
+    static void write(uint8_t *data, value_type v) {
+        Wire::write(data + Offset, v);
+    }
+};
+
+// Every field starts where the one it follows ends
+typedef MessageField<0, WireId> FieldId;                    // sender
+typedef MessageField<FieldId::end, WireMessage> FieldMsg;   // sender's message
+typedef MessageField<FieldMsg::end, WireScore> FieldScore;  // sender's score
+typedef MessageField<FieldMsg::end, WireId> FieldWinId;     // RESULT messages: winner, in place of the score
+typedef MessageField<FieldScore::end, WireId> FieldId2;     // COUNTER messages: the attacker
+typedef MessageField<FieldId2::end, WireMessage> FieldMsg2; // COUNTER messages: the attacker's message
+
+// Compile time checks over a message's fields, listed in the order they are sent
+template <typename... Fields>
+struct MessageFields;
+
+template <>
+struct MessageFields<> {
+    static constexpr uint8_t offset = 0xff;
+    static constexpr uint8_t end = 0;
+    template <typename Field>
+    static constexpr bool contains() {
+        return false;
+    }
+};
+
+template <typename First, typename... Rest>
+struct MessageFields<First, Rest...> {
+    static constexpr uint8_t offset = First::offset;
+    static constexpr uint8_t end = sizeof...(Rest) ? MessageFields<Rest...>::end : First::end;
+    static_assert(First::end <= MessageFields<Rest...>::offset, "message fields overlap or are out of order");
+    template <typename Field>
+    static constexpr bool contains() {
+        return std::is_same<Field, First>::value || MessageFields<Rest...>::template contains<Field>();
+    }
+};
+
+// A message type and its fields, the capabilities byte goes right after them
+template <uint8_t Type, typename... Fields>
+struct MessageSchema {
+    typedef MessageFields<Fields...> fields;
+    static constexpr uint8_t type = Type;
+    static constexpr uint8_t caps = fields::end;
+    static constexpr uint8_t length = caps + 1;
+};
+
+typedef MessageSchema<MESSAGE_TYPE_ATTACK, FieldId, FieldMsg, FieldScore> AttackMessage;
+typedef MessageSchema<MESSAGE_TYPE_ATTACK_ACK, FieldId, FieldMsg, FieldScore> AttackAckMessage;
+typedef MessageSchema<MESSAGE_TYPE_COUNTER_ATTACK, FieldId, FieldMsg, FieldScore, FieldId2, FieldMsg2> CounterAttackMessage;
+typedef MessageSchema<MESSAGE_TYPE_COUNTER_ATTACK_ACK, FieldId, FieldMsg, FieldScore, FieldId2, FieldMsg2> CounterAttackAckMessage;
+typedef MessageSchema<MESSAGE_TYPE_RESULT, FieldId, FieldMsg, FieldWinId> ResultMessage;
+typedef MessageSchema<MESSAGE_TYPE_RESULT_ACK, FieldId, FieldMsg, FieldWinId> ResultAckMessage;
+typedef MessageSchema<MESSAGE_TYPE_SCORE_ACK, FieldId, FieldMsg, FieldScore> ScoreAckMessage;
+
+static_assert(AttackMessage::length == 8 && CounterAttackMessage::length == 13 && ResultMessage::length == 10,
+        "message lengths include the trailing caps byte, older badges send one byte less");
+
+// Length of a message type, 0 for types that don't exist
+constexpr uint8_t messageLength(uint8_t type) {
+    return (type == MESSAGE_TYPE_ATTACK) ? AttackMessage::length :
+            (type == MESSAGE_TYPE_ATTACK_ACK) ? AttackAckMessage::length :
+            (type == MESSAGE_TYPE_COUNTER_ATTACK) ? CounterAttackMessage::length :
+            (type == MESSAGE_TYPE_COUNTER_ATTACK_ACK) ? CounterAttackAckMessage::length :
+            (type == MESSAGE_TYPE_RESULT) ? ResultMessage::length :
+            (type == MESSAGE_TYPE_RESULT_ACK) ? ResultAckMessage::length :
+            (type == MESSAGE_TYPE_SCORE_ACK) ? ScoreAckMessage::length : 0;
+}
+
+#define MESSAGE_MAX_LEN (CounterAttackMessage::length)
+
+// Reads fields straight out of a received frame, only the ones asked for.
+// Fields past the end of a short frame read as 0.
+class MessageReader {
+public:
+    MessageReader(const decode_results *results)
+        : data(&results->rx_data[1]), len((results->rx_len >= 2) ? results->rx_len - 2 : 0) {}
+    template <typename Field>
+    bool has() const {
+        return Field::end <= len;
+    }
+    template <typename Field>
+    typename Field::value_type get() const {
+        if (!has<Field>()) {
+            return typename Field::value_type();
+        }
+        return Field::read(data);
+    }
+    uint8_t type() const {
+        return has<FieldMsg>() ? (data[FieldMsg::offset] & MESSAGE_TYPE_MASK) >> MESSAGE_TYPE_OFFSET : 0;
+    }
+    // MESSAGE_CAPS_* of the sender, 0 from older ones that don't send them
+    uint8_t caps() const {
+        uint8_t length = messageLength(type());
+        return (length && len >= length) ? data[length - 1] : 0;
+    }
+private:
+    const uint8_t *data; // DATA bytes of the frame
+    int len;
+};
+
+// Writes the fields of one message type into a TX buffer, setting a field the
+// message type doesn't have doesn't compile
+template <typename Schema>
+class MessageWriter {
+public:
+    MessageWriter(uint8_t *buf, uint8_t caps = MESSAGE_CAPS) : buf(buf) {
+        buf[Schema::caps] = caps;
+    }
+    template <typename Field>
+    MessageWriter &set(typename Field::value_type v) {
+        static_assert(Schema::fields::template contains<Field>(), "field not in this message type");
+        Field::write(buf, v);
+        return *this;
+    }
+private:
+    uint8_t *buf;
+};
+
+#endif // BADGE_MESSAGE_H
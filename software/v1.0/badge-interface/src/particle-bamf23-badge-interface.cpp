@@ -12,8 +12,15 @@
 
 #include "Particle.h"
 #include "IRremoteLearn.h"
+#include "badge-message.h"
+#include "badge-identity.h"
+#include "badge-game.h"
 #include "neopixel.h"
 
+// Stream every raw IR capture over USB serial, read it with IRtraceReader.
+// Not while connected to the cyberdeck, it reads scores from the same port.
+#define ENABLE_IR_TRACE (0)
+
 SYSTEM_MODE(SEMI_AUTOMATIC);
 SYSTEM_THREAD(ENABLED);
 
@@ -33,42 +40,6 @@ const int IR_RX_PIN = D3;
 
 Adafruit_NeoPixel strip(PIXEL_COUNT, PIXEL_PIN, PIXEL_TYPE);
 
-// ATTACK (P1): HEADER:P1_ID:[MSG_TYP:MSG_BTN:MSG_STR]:P1_SCORE:CRC
-//              1:4:1:2 (8)
-//
-// COUNTER(P2): HEADER:P2_ID:[MSG_TYP:MSG_BTN:MSG_STR]:P2_SCORE:P1_ID:[MSG_TYP:MSG_BTN:MSG_STR]:CRC
-//              1:4:1:2:4:1 (13)
-//
-// RESULT (P1): HEADER:P1_ID:[MSG_TYP:MSG_BTN:MSG_STR]:P1_P2_ID:CRC
-//              1:4:1:4 (10)
-//
-// SCORE_ACK(P2): HEADER:P1_ID:[MSG_TYP:MSG_BTN:MSG_STR]:P1_SCORE:CRC
-//                1:4:1:2 (8)
-//
-#define MAGIC_HEADER_BYTE                   (0xA2)
-#define MESSAGE_TYPE_MASK                   (0xE0)
-#define MESSAGE_BUTTON_MASK                 (0x18)
-#define MESSAGE_STRENGTH_MASK               (0x07)
-#define MESSAGE_TYPE_OFFSET                 (5)
-#define MESSAGE_BUTTON_OFFSET               (3)
-#define MESSAGE_STRENGTH_OFFSET             (0)
-
-#define MESSAGE_TYPE_ATTACK                 (0)
-#define MESSAGE_TYPE_ATTACK_ACK             (1)
-#define MESSAGE_TYPE_COUNTER_ATTACK         (2)
-#define MESSAGE_TYPE_COUNTER_ATTACK_ACK     (3)
-#define MESSAGE_TYPE_RESULT                 (4)
-#define MESSAGE_TYPE_RESULT_ACK             (5)
-#define MESSAGE_TYPE_SCORE_ACK              (6)
-
-#define MESSAGE_TYPE_ATTACK_LEN             (8)
-#define MESSAGE_TYPE_ATTACK_ACK_LEN         (8)
-#define MESSAGE_TYPE_COUNTER_ATTACK_LEN     (13)
-#define MESSAGE_TYPE_COUNTER_ATTACK_ACK_LEN (13)
-#define MESSAGE_TYPE_RESULT_LEN             (10)
-#define MESSAGE_TYPE_RESULT_ACK_LEN         (10)
-#define MESSAGE_TYPE_SCORE_ACK_LEN          (8)
-
 #define SOUND_STATE_IDLE                    (0)
 #define SOUND_STATE_NEW                     (1)
 #define SOUND_STATE_PLAYING                 (2)
@@ -115,15 +86,9 @@ int badgeState = BADGE_STATE_IDLE;
 #define GAMEPLAY_STATE_RESULT_ACK           (6)
 #define GAMEPLAY_STATE_SCORE_ACK            (7)
 #define GAMEPLAY_STATE_RESULT_DISPLAY       (8)
-int gameStateP1 = GAMEPLAY_STATE_IDLE; // our state machine
+#define GAMEPLAY_STATE_COUNT                (9)
 int gameStateP2 = GAMEPLAY_STATE_IDLE; // keep track of their state machine
 
-struct IRMessage {
-                                   // MSB[AAA:BB:CCC]LSB
-    uint8_t strength:3;            //      |  |  \----- C = Strength (0-6)
-    uint8_t button:2;              //      |  \-------- B = Button   (0-3)
-    uint8_t type:3;                //      \----------- A = Type     (0-6)
-};
 struct IRData {
     uint8_t header;                // 0xA2 magic header byte, ó <- looks like a little water ballon
     uint32_t id;                   // Self ID
@@ -131,6 +96,7 @@ struct IRData {
     uint16_t score;                // Score always transmitted, used by leaderboard
     uint32_t id2;                  // Other ID
     IRMessage msg2;                // Message2 [x:Type:Button:Strength]
+    uint8_t caps;                  // MESSAGE_CAPS_* of the sender
     uint8_t valid;                 // Data valid
 };
 IRData irDataTx;
@@ -159,13 +125,11 @@ int gameResult = GAME_RESULT_INVALID;
 
 uint8_t randomNumber = 1;
 uint32_t startDieRoll = 0;
-uint32_t startGamestateTimer = 0;
 int rolling = 0;
-int retransmits = 0;
-uint32_t startRetransmit = 0;
-uint32_t retransmitDelay = 500;
+uint8_t peerCaps = 0; // MESSAGE_CAPS_* of the badge we are playing, 0 until it told us
+#define INTERFACE_CAPS (MESSAGE_CAPS & ~MESSAGE_CAPS_V2) // keeps score, doesn't play v2 matches
 #define GAME_STATE_TIMEOUT_MS (5000)
-#define DATA_BUF_LEN (13) // HEADER,                P1_ID, [MSG_TYP, MSG_BTN, MSG_STR], P1_SCORE, CRC
+#define DATA_BUF_LEN (MESSAGE_MAX_LEN) // HEADER,                P1_ID, [MSG_TYP, MSG_BTN, MSG_STR], P1_SCORE, CRC
 uint8_t dataBuf[DATA_BUF_LEN] = {}; // {0xA2,   0x12,0x34,0x56,0x78,                  0b00110111,     1200, 9};
 
 void rainbow(uint8_t wait);
@@ -189,61 +153,116 @@ const unsigned long SLEEP_TIMEOUT_MS = 60000;
 const unsigned long IDLE_TIMEOUT_MS = 100;
 const unsigned long MARK_TIMEOUT_US = 200;
 IRrecv irrecv(IR_RX_PIN, IDLE_TIMEOUT_MS, MARK_TIMEOUT_US);
+// Stray IR (phone depth mapping etc.) shows up as sub-100us spikes
+const unsigned long MIN_PULSE_US = 100;
 
 IRsend irsend(IR_TX_PIN);
+const irsymbols_t *txFrame = NULL; // txFrameData encoded once, replayed by every retransmit
+uint8_t txFrameData[DATA_BUF_LEN];
+int txFrameLen = 0;
+uint8_t txFramePhy = IR_PHY_NEC;
+uint8_t txFrameFormat = 0;
 
 extern uint8_t crc8(uint8_t data[], uint8_t len);
 
+// Send a frame from the transmit thread, the receiver keeps listening and drops our echo.
+// On NEC loop() hardly runs until the frame is out, the thread holds the scheduler.
+// Retransmits of the same bytes replay the frame encoded the first time.
+// Uses the PPM4 modulation, FEC coding and CRC-16 only for a badge that asks for PPM4,
+// which MESSAGE_CAPS doesn't: plain NEC frames survive more receiver lag. Longer NEC
+// frames would outlast the capture window, so FEC and CRC-16 go with PPM4 only.
+// Returns false if nothing went out, GameMachine tries again later.
+bool sendFrame(uint8_t *buf, int len) {
+    allocAuditBegin(ALLOC_AUDIT_TX);
+    uint8_t phy = (peerCaps & MESSAGE_CAPS_PPM4) ? IR_PHY_PPM4 : IR_PHY_NEC;
+    uint8_t format = 0;
+    if (phy == IR_PHY_PPM4) {
+        format |= (peerCaps & MESSAGE_CAPS_FEC) ? IR_FMT_FEC : 0;
+        format |= (peerCaps & MESSAGE_CAPS_CRC16) ? IR_FMT_CRC16 : 0;
+    }
+    if (!txFrame || len != txFrameLen || phy != txFramePhy || format != txFrameFormat ||
+            memcmp(buf, txFrameData, len)) {
+        irsend.release(txFrame);
+        txFrame = irsend.encodeBytes(buf, len, phy, format);
+        txFrameLen = txFrame ? len : 0; // encode again next time if it failed
+        memcpy(txFrameData, buf, txFrameLen);
+        txFramePhy = phy;
+        txFrameFormat = format;
+    }
+    bool sent = txFrame && irsend.sendSymbolsAsync(txFrame);
+    static bool failed = false;
+    if (!sent && !failed) {
+        Serial.printlnf("IR TX failed: len:%d encoded:%d", len, txFrame != NULL);
+        failed = true;
+    }
+    allocAuditEnd();
+    return sent;
+}
+
+// Collision avoidance counters since boot, printed when a match is over
+void printIrStats() {
+    irsend_stats_t stats;
+    irsend.stats(&stats);
+    Serial.printlnf("IR TX frames:%lu deferred:%lu backoffs:%lu forced:%lu backoff:%lums", stats.frames,
+            stats.deferred, stats.backoffs, stats.forced, stats.backoff_us / 1000);
+    // header timing of the frames that decoded, to tune NEC_HDR_MARK and MARK_EXCESS from
+    irrecv_stats_t rxStats;
+    irrecv.stats(&rxStats);
+    Serial.printlnf("IR RX frames:%lu calibrated:%lu stretch:%ldus skew:%ldppm crc:%lu errors:%lu", rxStats.frames,
+            rxStats.calibrated, rxStats.stretch_us_avg, rxStats.skew_ppm_avg, rxStats.crc_failures,
+            rxStats.decode_errors);
+    irrecv.dumpPeers(&Serial);
+    allocAuditPrint(&Serial);
+}
+
+void processMessage();
+void resetGame();
+void attackSent();
+void gameOver();
+
+// Our side of a match, one row per GAMEPLAY_STATE_*
+constexpr GameState gameTable[GAMEPLAY_STATE_COUNT] = {
+   // state                              name              message                      reply                    sends flags              rto_ms timeout_ms             onEnter  onSend          onSent    onFrame  onTimeout
+    { GAMEPLAY_STATE_IDLE,               "IDLE",           GAME_NO_MESSAGE,             GAME_NO_MESSAGE,         0,    0,                 0,     0,                     nullptr, nullptr,        nullptr,  nullptr, nullptr },
+    { GAMEPLAY_STATE_ATTACK,             "ATTACK",         MESSAGE_TYPE_ATTACK,         GAME_NO_MESSAGE,         1,    0,                 0,     GAME_STATE_TIMEOUT_MS, nullptr, attackSent,     nullptr,  nullptr, resetGame }, // answered by a player
+    { GAMEPLAY_STATE_ATTACK_ACK,         "ATTACK_ACK",     GAME_NO_MESSAGE,             GAME_NO_MESSAGE,         0,    0,                 0,     GAME_STATE_TIMEOUT_MS, nullptr, nullptr,        nullptr,  nullptr, resetGame },
+    { GAMEPLAY_STATE_COUNTER_ATTACK,     "COUNTER",        MESSAGE_TYPE_COUNTER_ATTACK, MESSAGE_TYPE_RESULT,     4,    0,                 3000,  GAME_STATE_TIMEOUT_MS, nullptr, attackSent,     nullptr,  nullptr, resetGame }, // after their splash
+    { GAMEPLAY_STATE_COUNTER_ATTACK_ACK, "COUNTER_ACK",    GAME_NO_MESSAGE,             GAME_NO_MESSAGE,         0,    0,                 0,     0,                     nullptr, nullptr,        nullptr,  nullptr, nullptr },
+    { GAMEPLAY_STATE_RESULT,             "RESULT",         MESSAGE_TYPE_RESULT,         MESSAGE_TYPE_RESULT_ACK, 5,    0,                 1000,  GAME_STATE_TIMEOUT_MS, nullptr, extendWakeTime, nullptr,  nullptr, resetGame },
+    { GAMEPLAY_STATE_RESULT_ACK,         "RESULT_ACK",     MESSAGE_TYPE_RESULT_ACK,     GAME_NO_MESSAGE,         1,    0,                 0,     0,                     nullptr, extendWakeTime, gameOver, nullptr, nullptr },
+    { GAMEPLAY_STATE_SCORE_ACK,          "SCORE_ACK",      MESSAGE_TYPE_SCORE_ACK,      GAME_NO_MESSAGE,         1,    GAME_BACK_TO_BACK, 0,     0,                     nullptr, extendWakeTime, gameOver, nullptr, nullptr },
+    { GAMEPLAY_STATE_RESULT_DISPLAY,     "RESULT_DISPLAY", GAME_NO_MESSAGE,             GAME_NO_MESSAGE,         0,    0,                 0,     0,                     nullptr, nullptr,        nullptr,  nullptr, nullptr }, // while we display results
+};
+static_assert(gameTableValid(gameTable, GAMEPLAY_STATE_COUNT), "gameTable rows out of order or incomplete");
+
+GameMachine game(gameTable, GAMEPLAY_STATE_COUNT, dataBuf, &irsend, sendFrame, processMessage); // our state machine
+
+// Every ATTACK and COUNTER we send fades the die out
+void attackSent() {
+    fadeOut(500);
+    extendWakeTime();
+}
+
+// Our last message of the match went out
+void gameOver() {
+    game.enter(GAMEPLAY_STATE_IDLE);
+    gameStateP2 = GAMEPLAY_STATE_IDLE;
+    colorPick = 0;
+    winner_id = 0;
+}
+
 STARTUP(
     pinMode(D7, INPUT_PULLDOWN);
+    irrecv.setGlitchFilter(MIN_PULSE_US, true); // only record frames that start with a header mark
+    irsend.setCarrierSense(&irrecv); // listen before talk, back off while another badge is sending
+    irrecv.setEchoSuppression(true); // keep listening while we send, a reply may follow right away
     irrecv.enableIRIn(); // Start the receiver
 )
 
-uint32_t deviceID_last4() {
-    String idStr = System.deviceID();
-    String idShort = idStr.substring(idStr.length()-8, idStr.length());
-    // Serial.printlnf("%s %s", idStr.c_str(), idShort.c_str());
-    char *ptr;
-    return strtoul(idShort.c_str(), &ptr, 16);
-}
-
 bool ids_equal(uint32_t my_id, uint32_t rcv_id) {
     return (my_id == rcv_id);
 }
 
-// #define PAR_LEN_OFF    (0)
-// #define PAR_HDR_OFF    (1)
-// #define PAR_ID1_OFF    (2)
-//                      //(3)
-//                      //(4)
-//                      //(5)
-// #define PAR_MSG1_OFF   (6)
-// #define PAR_WIN_ID_OFF (7)
-// #define PAR_SCR1_OFF   (7)
-// #define PAR_SCR2_OFF   (8)
-// #define PAR_ID2_OFF    (9)
-//                      //(10)
-//                      //(11)
-//                      //(12)
-// #define PAR_MSG2_OFF   (13)
-// #define PAR_CRC_OFF    (14)
-
-#define PAR_LEN_OFF    (0)
-// #define PAR_HDR_OFF    (1)
-#define PAR_ID1_OFF    (1)
-                     //(2)
-                     //(3)
-                     //(4)
-#define PAR_MSG1_OFF   (5)
-#define PAR_WIN_ID_OFF (6)
-#define PAR_SCR1_OFF   (6)
-#define PAR_SCR2_OFF   (7)
-#define PAR_ID2_OFF    (8)
-                     //(9)
-                     //(10)
-                     //(11)
-#define PAR_MSG2_OFF   (12)
-#define PAR_CRC_OFF    (13)
 int parse(decode_results *results) {
     // Parses the decode_results structure.
     // Call this after IRrecv::decode()
@@ -261,31 +280,26 @@ int parse(decode_results *results) {
     //     return -1;
     // }
 
-    uint8_t type = (results->rx_data[PAR_MSG1_OFF] & MESSAGE_TYPE_MASK) >> MESSAGE_TYPE_OFFSET;
-    if (type != MESSAGE_TYPE_COUNTER_ATTACK && type != MESSAGE_TYPE_COUNTER_ATTACK_ACK) {
-        irDataRx.msg.type = (results->rx_data[PAR_MSG1_OFF] & MESSAGE_TYPE_MASK) >> MESSAGE_TYPE_OFFSET;
-        irDataRx.msg.button = (results->rx_data[PAR_MSG1_OFF] & MESSAGE_BUTTON_MASK) >> MESSAGE_BUTTON_OFFSET;
-        irDataRx.msg.strength = (results->rx_data[PAR_MSG1_OFF] & MESSAGE_STRENGTH_MASK) >> MESSAGE_STRENGTH_OFFSET;
-        // Serial.printf(" T1:%d B1:%d S1:%d ", irDataRx.msg.type, irDataRx.msg.button, irDataRx.msg.strength);
-    } else {
-        irDataRx.msg.type = (results->rx_data[PAR_MSG1_OFF] & MESSAGE_TYPE_MASK) >> MESSAGE_TYPE_OFFSET;
-        irDataRx.msg.button = (results->rx_data[PAR_MSG1_OFF] & MESSAGE_BUTTON_MASK) >> MESSAGE_BUTTON_OFFSET;
-        irDataRx.msg.strength = (results->rx_data[PAR_MSG1_OFF] & MESSAGE_STRENGTH_MASK) >> MESSAGE_STRENGTH_OFFSET;
-        irDataRx.msg2.type = (results->rx_data[PAR_MSG2_OFF] & MESSAGE_TYPE_MASK) >> MESSAGE_TYPE_OFFSET;
-        irDataRx.msg2.button = (results->rx_data[PAR_MSG2_OFF] & MESSAGE_BUTTON_MASK) >> MESSAGE_BUTTON_OFFSET;
-        irDataRx.msg2.strength = (results->rx_data[PAR_MSG2_OFF] & MESSAGE_STRENGTH_MASK) >> MESSAGE_STRENGTH_OFFSET;
+    MessageReader in(results);
+    if (!in.has<FieldMsg>()) {
+        return -1;
+    }
+    irDataRx.msg = in.get<FieldMsg>();
+    if (irDataRx.msg.type == MESSAGE_TYPE_COUNTER_ATTACK || irDataRx.msg.type == MESSAGE_TYPE_COUNTER_ATTACK_ACK) {
+        irDataRx.msg2 = in.get<FieldMsg2>();
         // Serial.printf(" T1:%d B1:%d S1:%d T2:%d B2:%d S2:%d ", irDataRx.msg.type, irDataRx.msg.button, irDataRx.msg.strength,
                                                               // irDataRx.msg2.type, irDataRx.msg2.button, irDataRx.msg2.strength);
+    } else {
+        // Serial.printf(" T1:%d B1:%d S1:%d ", irDataRx.msg.type, irDataRx.msg.button, irDataRx.msg.strength);
     }
 
-    player2score = (results->rx_data[PAR_SCR1_OFF] << 8) + results->rx_data[PAR_SCR2_OFF];
+    player2score = in.get<FieldScore>();
     // Serial.printf("player2score:%d", player2score);
 
-    uint32_t rcv_id = 0;
+    uint32_t rcv_id = in.get<FieldId>();
     uint32_t win_id = 0;
     uint32_t acked_id = 0;
-    memcpy(&rcv_id, &results->rx_data[PAR_ID1_OFF], 4);
-    if (ids_equal(deviceID_last4(), rcv_id)) {
+    if (ids_equal(badgeId, rcv_id)) {
         // Serial.println("My own ID!!");
         return -2;
     } else {
@@ -294,9 +308,9 @@ int parse(decode_results *results) {
     irDataRx.id = rcv_id;
 
     if (irDataRx.msg.type == MESSAGE_TYPE_RESULT || irDataRx.msg.type == MESSAGE_TYPE_RESULT_ACK) {
-        memcpy(&win_id, &results->rx_data[PAR_WIN_ID_OFF], 4);
-        // Serial.printlnf("(US) player1id:%08lX %d [win_id:%08lX] player2id:%08lX %d (THEM)", deviceID_last4(), player1msg.strength, win_id, player2id, player2msg.strength);
-        if (ids_equal(deviceID_last4(), win_id) ||
+        win_id = in.get<FieldWinId>();
+        // Serial.printlnf("(US) player1id:%08lX %d [win_id:%08lX] player2id:%08lX %d (THEM)", badgeId, player1msg.strength, win_id, player2id, player2msg.strength);
+        if (ids_equal(badgeId, win_id) ||
                 ids_equal(player2id, win_id) ||
                 ids_equal(GAME_IS_A_DRAW_ID, win_id)) {
             irDataRx.id2 = win_id;
@@ -308,8 +322,8 @@ int parse(decode_results *results) {
             return -3;
         }
     } else if (irDataRx.msg.type == MESSAGE_TYPE_COUNTER_ATTACK) {
-        memcpy(&acked_id, &results->rx_data[PAR_ID2_OFF], 4);
-        if (ids_equal(deviceID_last4(), acked_id)) {
+        acked_id = in.get<FieldId2>();
+        if (ids_equal(badgeId, acked_id)) {
             // Serial.println("My own ID ACK'd");
         } else {
             // Serial.println("Another ACK'd ID!!");
@@ -318,6 +332,10 @@ int parse(decode_results *results) {
         irDataRx.id2 = acked_id;
     }
 
+    // Older badges don't send the capabilities byte. Any badge in range may be talking,
+    // peerCaps is only taken from the one we play (processMessage())
+    irDataRx.caps = in.caps();
+
     irDataRx.valid = 1;
     return 0;
 }
@@ -846,7 +864,9 @@ int buttonPressed() {
 }
 
 void setup() {
+    identityBegin(); // before anything compares IDs
     // irrecv.enableIRIn(); // Start the receiver
+    irrecv.setPeerId(1 + FieldId::offset); // link quality per sender, see printIrStats()
     irsend.enableIROut(38);
     pinMode(PIXEL_ENABLE_PIN, OUTPUT);
     digitalWrite(PIXEL_ENABLE_PIN, HIGH);
@@ -860,6 +880,10 @@ void setup() {
     pinMode(BUTTON_4_PIN, INPUT_PULLUP);
 
     Serial.begin();
+#if ENABLE_IR_TRACE
+    Serial.blockOnOverrun(false); // drop trace records rather than stall when nobody is reading
+    irrecv.setTrace(&Serial);
+#endif // ENABLE_IR_TRACE
 
     pinMode(SPEAKER_PIN, OUTPUT);
     analogWrite(SPEAKER_PIN, 0, 1000);
@@ -874,78 +898,51 @@ void setup() {
     delay(5000);
 }
 
-// #define MSG_HDR_OFF    (0)
-// #define MSG_ID1_OFF    (1)
-//                      //(2)
-//                      //(3)
-//                      //(4)
-// #define MSG_MSG1_OFF   (5)
-// #define MSG_WIN_ID_OFF (6)
-// #define MSG_SCR1_OFF   (6)
-// #define MSG_SCR2_OFF   (7)
-// #define MSG_ID2_OFF    (8)
-//                      //(9)
-//                      //(10)
-//                      //(11)
-// #define MSG_MSG2_OFF   (12)
-
-// #define MSG_HDR_OFF    (0)
-#define MSG_ID1_OFF    (0)
-                     //(1)
-                     //(2)
-                     //(3)
-#define MSG_MSG1_OFF   (4)
-#define MSG_WIN_ID_OFF (5)
-#define MSG_SCR1_OFF   (5)
-#define MSG_SCR2_OFF   (6)
-#define MSG_ID2_OFF    (7)
-                     //(8)
-                     //(9)
-                     //(10)
-#define MSG_MSG2_OFF   (11)
 void createMessage(uint8_t* buf, int msgType, int button, int strength, uint32_t id, void* player2msg) {
-    uint32_t id32bit = deviceID_last4();
+    uint32_t id32bit = badgeId;
+    IRMessage msg = {};
+    msg.type = msgType;
+    msg.button = button;
+    msg.strength = strength;
     // buf[0] = MAGIC_HEADER_BYTE; // magic header byte, ó - looks like a little waterballon
-    memcpy(&buf[MSG_ID1_OFF], &id32bit, 4);
-    buf[MSG_SCR1_OFF] = player1score >> 8;
-    buf[MSG_SCR2_OFF] = player1score & 0xff;
     // Serial.printlnf("msgType:%d", msgType);
     switch (msgType) {
         case MESSAGE_TYPE_ATTACK: {
-            buf[MSG_MSG1_OFF] = (MESSAGE_TYPE_ATTACK << MESSAGE_TYPE_OFFSET) + (button << MESSAGE_BUTTON_OFFSET) + (strength);
+            MessageWriter<AttackMessage> out(buf, INTERFACE_CAPS);
+            out.set<FieldId>(id32bit).set<FieldMsg>(msg).set<FieldScore>(player1score);
             break;
         }
         case MESSAGE_TYPE_ATTACK_ACK: {
-            buf[MSG_MSG1_OFF] = (MESSAGE_TYPE_ATTACK_ACK << MESSAGE_TYPE_OFFSET) + (button << MESSAGE_BUTTON_OFFSET) + (strength);
+            MessageWriter<AttackAckMessage> out(buf, INTERFACE_CAPS);
+            out.set<FieldId>(id32bit).set<FieldMsg>(msg).set<FieldScore>(player1score);
             break;
         }
         case MESSAGE_TYPE_COUNTER_ATTACK: {
-            buf[MSG_MSG1_OFF] = (MESSAGE_TYPE_COUNTER_ATTACK << MESSAGE_TYPE_OFFSET) + (button << MESSAGE_BUTTON_OFFSET) + (strength);
-            memcpy(&buf[MSG_ID2_OFF], &id, 4);
+            MessageWriter<CounterAttackMessage> out(buf, INTERFACE_CAPS);
+            out.set<FieldId>(id32bit).set<FieldMsg>(msg).set<FieldScore>(player1score).set<FieldId2>(id);
             if (player2msg) {
-                buf[MSG_MSG2_OFF] = *((uint8_t*)player2msg);
-                // Serial.printlnf("player2msg:%02x", buf[12]);
+                out.set<FieldMsg2>(*((IRMessage*)player2msg));
             }
             break;
         }
         case MESSAGE_TYPE_COUNTER_ATTACK_ACK: {
-            buf[MSG_MSG1_OFF] = (MESSAGE_TYPE_COUNTER_ATTACK_ACK << MESSAGE_TYPE_OFFSET) + (button << MESSAGE_BUTTON_OFFSET) + (strength);
+            MessageWriter<CounterAttackAckMessage> out(buf, INTERFACE_CAPS);
+            out.set<FieldId>(id32bit).set<FieldMsg>(msg).set<FieldScore>(player1score);
             break;
         }
         case MESSAGE_TYPE_RESULT: {
-            buf[MSG_MSG1_OFF] = (MESSAGE_TYPE_RESULT << MESSAGE_TYPE_OFFSET) + (button << MESSAGE_BUTTON_OFFSET) + (strength);
-            // Serial.printlnf("MESSAGE_TYPE_RESULT buf[MSG_MSG1_OFF]:%02X %02X %02X", buf[MSG_MSG1_OFF], (MESSAGE_TYPE_RESULT << MESSAGE_TYPE_OFFSET), (MESSAGE_TYPE_COUNTER_ATTACK_ACK << MESSAGE_TYPE_OFFSET) + (button << MESSAGE_BUTTON_OFFSET) + (strength));
-            memcpy(&buf[MSG_WIN_ID_OFF], &id, 4); // should be the winner_id
+            MessageWriter<ResultMessage> out(buf, INTERFACE_CAPS);
+            out.set<FieldId>(id32bit).set<FieldMsg>(msg).set<FieldWinId>(id); // should be the winner_id
             break;
         }
         case MESSAGE_TYPE_RESULT_ACK: {
-            buf[MSG_MSG1_OFF] = (MESSAGE_TYPE_RESULT_ACK << MESSAGE_TYPE_OFFSET) + (button << MESSAGE_BUTTON_OFFSET) + (strength);
-            // Serial.printlnf("MESSAGE_TYPE_RESULT_ACK buf[MSG_MSG1_OFF]:%02X %02X %02X", buf[MSG_MSG1_OFF], (MESSAGE_TYPE_RESULT << MESSAGE_TYPE_OFFSET), (MESSAGE_TYPE_COUNTER_ATTACK_ACK << MESSAGE_TYPE_OFFSET) + (button << MESSAGE_BUTTON_OFFSET) + (strength));
-            memcpy(&buf[MSG_WIN_ID_OFF], &id, 4); // should be the winner_id
+            MessageWriter<ResultAckMessage> out(buf, INTERFACE_CAPS);
+            out.set<FieldId>(id32bit).set<FieldMsg>(msg).set<FieldWinId>(id); // should be the winner_id
             break;
         }
         case MESSAGE_TYPE_SCORE_ACK: {
-            buf[MSG_MSG1_OFF] = (MESSAGE_TYPE_SCORE_ACK << MESSAGE_TYPE_OFFSET) + (button << MESSAGE_BUTTON_OFFSET) + (strength);
+            MessageWriter<ScoreAckMessage> out(buf, INTERFACE_CAPS);
+            out.set<FieldId>(id32bit).set<FieldMsg>(msg).set<FieldScore>(player1score);
             break;
         }
         default: {
@@ -961,8 +958,11 @@ void createMessage(uint8_t* buf, int msgType, int button, int strength, uint32_t
 }
 
 void resetGame() {
-    gameStateP1 = GAMEPLAY_STATE_IDLE;
+    printIrStats();
+    game.printRtt(&Serial);
+    game.enter(GAMEPLAY_STATE_IDLE);
     gameStateP2 = GAMEPLAY_STATE_IDLE;
+    peerCaps = 0;
     colorPick = 0;
     winner_id = 0;
     gameResult = GAME_RESULT_INVALID;
@@ -972,11 +972,11 @@ void resetGame() {
 int checkGameResults() {
     int gameResult = GAME_RESULT_INVALID;
 
-    // Serial.printlnf("(US) player1id:%08lX %d [received_winner:%08lX winner_id:%08lX ] player2id:%08lX %d (THEM)", deviceID_last4(), player1msg.strength, received_winner_id, winner_id, player2id, player2msg.strength);
+    // Serial.printlnf("(US) player1id:%08lX %d [received_winner:%08lX winner_id:%08lX ] player2id:%08lX %d (THEM)", badgeId, player1msg.strength, received_winner_id, winner_id, player2id, player2msg.strength);
 
     // Validate winner_id received against our own calculation
     if (received_winner_id == winner_id) {
-        if (deviceID_last4() == winner_id) {
+        if (badgeId == winner_id) {
             // Serial.printlnf("++++ WIN! ++++");
             gameResult = GAME_RESULT_WIN;
             setDieNum(player1msg.strength, DIE_COLOR_GREEN);
@@ -1023,6 +1023,7 @@ void processMessage() {
             // Save P2 data
             player2id = irDataRx.id;
             player2msg = irDataRx.msg;
+            peerCaps = irDataRx.caps;
 
             sendScoreToLeaderboard();
 
@@ -1032,20 +1033,17 @@ void processMessage() {
 
             badgeState = BADGE_STATE_SPLASH;
             gameStateP2 = GAMEPLAY_STATE_ATTACK;
-            gameStateP1 = GAMEPLAY_STATE_SCORE_ACK;
 
-            startGamestateTimer = 0;
-            retransmits = 1;
-            startRetransmit = millis() - (retransmitDelay*2); // Send immediately!
             memset(dataBuf, 0, DATA_BUF_LEN);
             createMessage(dataBuf, MESSAGE_TYPE_SCORE_ACK, 0, 0);
+            game.enter(GAMEPLAY_STATE_SCORE_ACK);
 
             RGB.color(0, 0, 0);
 
             // memset(dataBuf, 0, DATA_BUF_LEN);
             // createMessage(dataBuf, MESSAGE_TYPE_ATTACK_ACK, irDataRx.msg.button, irDataRx.msg.strength);
             // irrecv.disableIRIn();
-            // irsend.sendBytes(dataBuf, MESSAGE_TYPE_ATTACK_ACK_LEN);
+            // irsend.sendBytes(dataBuf, AttackAckMessage::length);
             // irrecv.enableIRIn();
             // Serial.printlnf("QUICK ATTACK_ACK");
             break;
@@ -1062,6 +1060,7 @@ void processMessage() {
             // Save P2 data
             player2id = irDataRx.id;
             player2msg = irDataRx.msg;
+            peerCaps = irDataRx.caps;
 
             sendScoreToLeaderboard();
 
@@ -1072,17 +1071,15 @@ void processMessage() {
             badgeState = BADGE_STATE_SPLASH;
             gameStateP2 = GAMEPLAY_STATE_COUNTER_ATTACK;
 
-            startGamestateTimer = 0;
-            retransmits = 1;
-            startRetransmit = millis() - (retransmitDelay*2); // Send immediately!
             memset(dataBuf, 0, DATA_BUF_LEN);
             createMessage(dataBuf, MESSAGE_TYPE_SCORE_ACK, 0, 0);
+            game.resend();
 
             RGB.color(0, 0, 0);
 
             // determine winner ahead of time
             if (player1msg.strength > player2msg.strength) {
-                winner_id = deviceID_last4();
+                winner_id = badgeId;
             } else if (player1msg.strength < player2msg.strength) {
                 winner_id = player2id;
             } else {
@@ -1094,8 +1091,6 @@ void processMessage() {
         case MESSAGE_TYPE_RESULT: {
             // Serial.printlnf("PROCESS RESULT");
 
-            retransmits = 1;
-            startRetransmit = millis() - (retransmitDelay*2); // Send immediately!
             memset(dataBuf, 0, DATA_BUF_LEN);
             createMessage(dataBuf, MESSAGE_TYPE_RESULT_ACK, 0, 0, winner_id);
 
@@ -1103,7 +1098,7 @@ void processMessage() {
 
             badgeState = BADGE_STATE_DISPLAY_RESULT;
             gameStateP2 = GAMEPLAY_STATE_RESULT_DISPLAY;
-            gameStateP1 = GAMEPLAY_STATE_RESULT_ACK;
+            game.enter(GAMEPLAY_STATE_RESULT_ACK);
 
             break;
         }
@@ -1113,7 +1108,7 @@ void processMessage() {
             gameResult = checkGameResults();
 
             badgeState = BADGE_STATE_DISPLAY_RESULT;
-            gameStateP1 = GAMEPLAY_STATE_RESULT_DISPLAY;
+            game.enter(GAMEPLAY_STATE_RESULT_DISPLAY);
 
             break;
         }
@@ -1131,20 +1126,23 @@ void loop() {
     switch (badgeState) {
         case BADGE_STATE_IDLE: {
             // READ AND DECODE INCOMING IR
+            allocAuditBegin(ALLOC_AUDIT_RX);
             int ir_res = irrecv.decode(&irResults);
             if (ir_res) {
                 if (irResults.decode_type == BYTES) {
                     if (parse(&irResults) == 0 && irDataRx.valid) {
                         badgeState = BADGE_STATE_MESSAGE_AVAILABLE;
                         // Serial.printlnf("irDataRx.msg:%02X, irDataRx.msg.type:%02X", *((uint8_t *)&irDataRx.msg), irDataRx.msg.type);
-                        processMessage();
+                        game.frame(&irResults);
                     }
                 }
                 irrecv.resume(); // make sure to clear and re-enable IR after all tests above
+                allocAuditEnd();
                 if (badgeState == BADGE_STATE_MESSAGE_AVAILABLE) {
                     break;
                 }
             } else {
+                allocAuditEnd();
                 // Serial.printlnf("ir_res: %d", ir_res);
             }
 
@@ -1193,26 +1191,26 @@ void loop() {
             }
             if (!rolling) {
                 badgeState = BADGE_STATE_IDLE;
-                retransmits = 1;
-                startRetransmit = millis() - (retransmitDelay*2); // Send immediately!
                 memset(dataBuf, 0, DATA_BUF_LEN);
                 if (gameStateP2 == GAMEPLAY_STATE_IDLE) {
-                    gameStateP1 = GAMEPLAY_STATE_ATTACK;
+                    peerCaps = 0; // opening a match, nobody answered yet
                     createMessage(dataBuf, MESSAGE_TYPE_ATTACK, colorPick-1, randomNumber);
+                    game.enter(GAMEPLAY_STATE_ATTACK);
                 } else if (gameStateP2 == GAMEPLAY_STATE_ATTACK) {
-                    gameStateP1 = GAMEPLAY_STATE_COUNTER_ATTACK;
                     createMessage(dataBuf, MESSAGE_TYPE_COUNTER_ATTACK, colorPick-1, randomNumber, player2id, &player2msg);
+                    game.enter(GAMEPLAY_STATE_COUNTER_ATTACK);
 
                     // determine winner ahead of time
                     if (player1msg.strength > player2msg.strength) {
-                        winner_id = deviceID_last4();
+                        winner_id = badgeId;
                     } else if (player1msg.strength < player2msg.strength) {
                         winner_id = player2id;
                     } else {
                         winner_id = GAME_IS_A_DRAW_ID;
                     }
+                } else {
+                    game.resend();
                 }
-                startGamestateTimer = 0;
             }
             break;
         }
@@ -1261,197 +1259,5 @@ void loop() {
         }
     }
 
-
-    switch (gameStateP1) {
-        case GAMEPLAY_STATE_IDLE: {
-            break;
-        }
-        case GAMEPLAY_STATE_ATTACK: {
-
-            if ((retransmits > 0) && (millis() - startRetransmit > retransmitDelay)) {
-
-                irrecv.disableIRIn();
-                irsend.sendBytes(dataBuf, MESSAGE_TYPE_ATTACK_LEN);
-                irrecv.enableIRIn();
-
-                // Serial.printlnf("ATTACK:%d", retransmits);
-
-                // if (retransmits == 10) {
-                    fadeOut(500);
-                // } else {
-                    retransmitDelay = 500; // * (random(4)+1);
-                    startRetransmit = millis();
-                // }
-                // while (buttonPressed());
-                // playSound(colorPick, SOUND_STATE_FINISHED); // ensure sound has stopped
-                extendWakeTime();
-                retransmits--;
-                if (retransmits == 0) {
-                    startGamestateTimer = millis();
-                }
-            }
-            if (startGamestateTimer && (millis() - startGamestateTimer > GAME_STATE_TIMEOUT_MS)) {
-                startGamestateTimer = 0;
-                resetGame();
-                // Serial.printlnf("ATTACK TIMEOUT");
-            }
-            break;
-        }
-        case GAMEPLAY_STATE_ATTACK_ACK: {
-
-            if (startGamestateTimer && (millis() - startGamestateTimer > GAME_STATE_TIMEOUT_MS)) {
-                startGamestateTimer = 0;
-                resetGame();
-                // Serial.printlnf("ATTACK_ACK TIMEOUT");
-            }
-            break;
-        }
-        case GAMEPLAY_STATE_COUNTER_ATTACK: {
-
-            if ((retransmits > 0) && (millis() - startRetransmit > retransmitDelay)) {
-
-                irrecv.disableIRIn();
-                irsend.sendBytes(dataBuf, MESSAGE_TYPE_COUNTER_ATTACK_LEN);
-                irrecv.enableIRIn();
-
-                // Serial.printlnf("COUNTER:%d", retransmits);
-
-                // if (retransmits == 10) {
-                    fadeOut(500);
-                // } else {
-                    retransmitDelay = 500; // * (random(4)+1);
-                    startRetransmit = millis();
-                // }
-                // while (buttonPressed());
-                // playSound(colorPick, SOUND_STATE_FINISHED); // ensure sound has stopped
-                extendWakeTime();
-                retransmits--;
-                if (retransmits == 0) {
-                    startGamestateTimer = millis();
-                }
-            }
-            if (startGamestateTimer && (millis() - startGamestateTimer > GAME_STATE_TIMEOUT_MS)) {
-                startGamestateTimer = 0;
-                resetGame();
-                // Serial.printlnf("COUNTER TIMEOUT");
-            }
-            break;
-        }
-        case GAMEPLAY_STATE_COUNTER_ATTACK_ACK: {
-            break;
-        }
-        case GAMEPLAY_STATE_RESULT: {
-
-            if ((retransmits > 0) && (millis() - startRetransmit > retransmitDelay)) {
-
-                irrecv.disableIRIn();
-                irsend.sendBytes(dataBuf, MESSAGE_TYPE_RESULT_LEN);
-                irrecv.enableIRIn();
-
-                // Serial.printlnf("RESULT:%d", retransmits);
-
-                // if (retransmits == 1) {
-                    // fadeOut(1000);
-                // } else {
-                    retransmitDelay = 500; // * (random(4)+1);
-                    startRetransmit = millis();
-                // }
-                // while (buttonPressed());
-                // playSound(colorPick, SOUND_STATE_FINISHED); // ensure sound has stopped
-                extendWakeTime();
-                retransmits--;
-                if (retransmits == 0) {
-                    startGamestateTimer = millis();
-                }
-            }
-            if (startGamestateTimer && (millis() - startGamestateTimer > GAME_STATE_TIMEOUT_MS)) {
-                startGamestateTimer = 0;
-                resetGame();
-                // Serial.printlnf("RESULT TIMEOUT");
-            }
-            break;
-        }
-        case GAMEPLAY_STATE_RESULT_ACK: {
-
-            if ((retransmits > 0) && (millis() - startRetransmit > retransmitDelay)) {
-
-                irrecv.disableIRIn();
-                irsend.sendBytes(dataBuf, MESSAGE_TYPE_RESULT_ACK_LEN);
-                irrecv.enableIRIn();
-
-                // Serial.printlnf("RESULT_ACK:%d", retransmits);
-
-                // if (retransmits == 10) {
-                    // fadeOut(1000);
-                // } else {
-                    retransmitDelay = 500; // * (random(4)+1);
-                    startRetransmit = millis();
-                // }
-                // while (buttonPressed());
-                // playSound(colorPick, SOUND_STATE_FINISHED); // ensure sound has stopped
-                extendWakeTime();
-                retransmits--;
-                if (retransmits == 0) {
-                    // startGamestateTimer = millis();
-
-                    startGamestateTimer = 0;
-                    gameStateP1 = GAMEPLAY_STATE_IDLE;
-                    gameStateP2 = GAMEPLAY_STATE_IDLE;
-                    colorPick = 0;
-                    winner_id = 0;
-                }
-            }
-            if (startGamestateTimer && (millis() - startGamestateTimer > GAME_STATE_TIMEOUT_MS)) {
-                startGamestateTimer = 0;
-                resetGame();
-                // Serial.printlnf("RESULT_ACK TIMEOUT");
-            }
-            break;
-        }
-        case GAMEPLAY_STATE_RESULT_DISPLAY: {
-            // temp gameplay state while we display results
-            break;
-        }
-        case GAMEPLAY_STATE_SCORE_ACK: {
-            // if ((retransmits > 0) && (millis() - startRetransmit > retransmitDelay)) {
-
-                irrecv.disableIRIn();
-                irsend.sendBytes(dataBuf, MESSAGE_TYPE_SCORE_ACK_LEN);
-                irrecv.enableIRIn();
-
-                // Serial.printlnf("SCORE_ACK:%d", retransmits);
-
-                // if (retransmits == 10) {
-                    // fadeOut(1000);
-                // } else {
-                    retransmitDelay = 500; // * (random(4)+1);
-                    startRetransmit = millis();
-                // }
-                // while (buttonPressed());
-                // playSound(colorPick, SOUND_STATE_FINISHED); // ensure sound has stopped
-                extendWakeTime();
-                retransmits--;
-                if (retransmits == 0) {
-                    // startGamestateTimer = millis();
-
-                    startGamestateTimer = 0;
-                    gameStateP1 = GAMEPLAY_STATE_IDLE;
-                    gameStateP2 = GAMEPLAY_STATE_IDLE;
-                    colorPick = 0;
-                    winner_id = 0;
-                }
-            // }
-            // if (startGamestateTimer && (millis() - startGamestateTimer > GAME_STATE_TIMEOUT_MS)) {
-            //     startGamestateTimer = 0;
-            //     resetGame();
-            //     Serial.printlnf("SCORE_ACK TIMEOUT");
-            // }
-            break;
-        }
-        default: {
-            break;
-        }
-    }
-
-
+    game.poll(); // retransmits and timeouts of our side of the match
 }
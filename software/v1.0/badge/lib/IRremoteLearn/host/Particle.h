@@ -0,0 +1,104 @@
+/*
+ * IRremoteLearn host shim
+ *
+ * Just enough of the Particle API to build the library on Linux, so the capture
+ * and decoders can be driven by IRReplayEdgeSource / IRSyntheticEdgeSource.
+ * Put this directory on the include path ahead of the library, see README.md.
+ * Pins do nothing and time comes from the host's monotonic clock, or with
+ * IR_HOST_VIRTUAL_CLOCK defined from host_clock_us, which only the program and the
+ * delays move on.
+ */
+
+#ifndef IRremoteLearn_host_Particle_h
+#define IRremoteLearn_host_Particle_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+typedef uint16_t pin_t;
+
+enum { INPUT, OUTPUT, INPUT_PULLUP, INPUT_PULLDOWN };
+enum { LOW = 0, HIGH = 1, CHANGE, RISING, FALLING };
+enum { D0, D1, D2, D3, D4, D5, D6, D7, A0, A1, A2, A3, A4, A5, TX, RX };
+#define DEC 10
+#define HEX 16
+
+#ifdef IR_HOST_VIRTUAL_CLOCK
+inline unsigned long host_clock_us = 0;
+inline unsigned long micros() { return host_clock_us; }
+inline void delayMicroseconds(unsigned int us) { host_clock_us += us; }
+#else
+inline unsigned long micros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)(ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000);
+}
+inline void delayMicroseconds(unsigned int us) { unsigned long t = micros(); while (micros() - t < us) {} }
+#endif
+inline unsigned long millis() { return micros() / 1000; }
+inline void delay(unsigned long ms) { delayMicroseconds(ms * 1000); }
+inline long random(long max) { return (max > 0) ? rand() % max : 0; }
+
+inline void pinMode(pin_t pin, int mode) {}
+inline int pinReadFast(pin_t pin) { return HIGH; }
+inline void digitalWriteFast(pin_t pin, int value) {}
+inline void analogWrite(pin_t pin, int value, int hz = 0) {}
+inline bool attachInterrupt(pin_t pin, void (*handler)(), int mode) { return false; }
+inline bool detachInterrupt(pin_t pin) { return true; }
+
+// Single threaded on the host
+#define ATOMIC_BLOCK() for (bool __todo = true; __todo; __todo = false)
+#define SINGLE_THREADED_BLOCK() for (bool __todo = true; __todo; __todo = false)
+
+class Print {
+public:
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buf, size_t len) {
+        size_t n = 0;
+        while (len--) {
+            n += write(*buf++);
+        }
+        return n;
+    }
+    size_t printf(const char *fmt, ...) {
+        va_list args;
+        va_start(args, fmt);
+        size_t n = vprint(fmt, args);
+        va_end(args);
+        return n;
+    }
+    size_t printlnf(const char *fmt, ...) {
+        va_list args;
+        va_start(args, fmt);
+        size_t n = vprint(fmt, args);
+        va_end(args);
+        return n + write('\n');
+    }
+private:
+    size_t vprint(const char *fmt, va_list args) {
+        char buf[256];
+        int n = vsnprintf(buf, sizeof(buf), fmt, args);
+        return (n > 0) ? write((const uint8_t *)buf, ((size_t)n < sizeof(buf)) ? n : sizeof(buf) - 1) : 0;
+    }
+};
+
+// Serial output goes to stdout
+struct HostSerial : public Print {
+    using Print::write;
+    size_t write(uint8_t c) { return fputc(c, stdout) == EOF ? 0 : 1; }
+    void begin(long baud = 9600) {}
+    void blockOnOverrun(bool block) {}
+    size_t print(const char *s) { return fputs(s, stdout); }
+    size_t print(long n, int base = DEC) { return ::printf(base == HEX ? "%lX" : "%ld", n); }
+    size_t println(const char *s = "") { return ::printf("%s\n", s); }
+    size_t println(long n, int base = DEC) { return print(n, base) + println(); }
+};
+inline HostSerial Serial;
+
+#endif // IRremoteLearn_host_Particle_h
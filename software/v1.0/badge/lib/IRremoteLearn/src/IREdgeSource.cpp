@@ -0,0 +1,208 @@
+/*
+ * IRremoteLearn
+ *
+ * Edge sources for IRrecv: the receiver pin interrupt, recorded trace replay
+ * and a synthetic BYTES frame generator.
+ */
+
+#include "Particle.h"
+
+#include "IRremoteLearn.h"
+#include "IRremoteLearnInt.h"
+#include "IREdgeSource.h"
+
+bool ir_edge_push(unsigned long time_us, uint8_t level) {
+    uint16_t head = irparams.edge_head;
+    uint16_t next = (head + 1) & (IR_EDGE_RING - 1);
+    if (next == irparams.edge_tail) {
+        irparams.edge_overflows++; // consumer is behind, drop the edge
+        return false;
+    }
+    irparams.edges[head] = (time_us & ~1UL) | level; // pin level lives in bit 0
+    irparams.edge_head = next; // publish after the slot is written
+    return true;
+}
+
+// The ISR only timestamps edges into irparams.edges, a single-producer/single-consumer
+// ring. IRrecv::decode() drains the ring and runs the MARK/SPACE state machine,
+// so ISR time is constant no matter how long the frame is.
+static void ir_recv_handler() {
+    // irparams.current_time = System.ticks()/120; // optional hardware timer on Photon/P1/Electron
+    uint32_t now = micros();
+    uint8_t irdata = (uint8_t)pinReadFast(irparams.rxpin);
+
+    ir_edge_push(now, irdata);
+
+    if (irparams.blinkflag) {
+        if (irdata == MARK) {
+            BLINKLED_ON();  // turn pin D7 LED on
+        }
+        else {
+            BLINKLED_OFF(); // turn pin D7 LED off
+        }
+    }
+}
+
+// Constructed on first use, IRrecv objects are often globals themselves
+IRGpioEdgeSource &IRGpioEdgeSource::instance() {
+    static IRGpioEdgeSource source;
+    return source;
+}
+
+void IRGpioEdgeSource::begin(int rxpin) {
+    this->rxpin = rxpin;
+    // set pin modes
+    pinMode(rxpin, INPUT);
+    // enable ir_recv_handler for Learner style IR receivers such as the Vishay TSMP58000
+    // http://www.vishay.com/docs/82485/tsmp58000.pdf
+    attachInterrupt(rxpin, ir_recv_handler, CHANGE);
+}
+
+void IRGpioEdgeSource::end() {
+    if (rxpin >= 0) {
+        detachInterrupt(rxpin);
+    }
+}
+
+unsigned long IRGpioEdgeSource::now() {
+    return micros();
+}
+
+IRReplayEdgeSource::IRReplayEdgeSource(unsigned long burst_gap_us) {
+    this->burst_gap_us = burst_gap_us;
+    file = NULL;
+    clock = 0;
+    have_next = false;
+}
+
+bool IRReplayEdgeSource::open(const char *path) {
+    close();
+    file = fopen(path, "r");
+    if (!file) {
+        return false;
+    }
+    have_next = next();
+    return true;
+}
+
+void IRReplayEdgeSource::close() {
+    if (file) {
+        fclose(file);
+        file = NULL;
+    }
+    have_next = false;
+}
+
+bool IRReplayEdgeSource::done() {
+    return !have_next;
+}
+
+unsigned long IRReplayEdgeSource::now() {
+    return clock;
+}
+
+// Read the next edge from the trace
+bool IRReplayEdgeSource::next() {
+    char line[64];
+    while (file && fgets(line, sizeof(line), file)) {
+        unsigned long time_us;
+        unsigned int level;
+        if (line[0] != '#' && sscanf(line, "%lu %u", &time_us, &level) == 2) {
+            next_time = time_us;
+            next_level = level ? SPACE : MARK;
+            return true;
+        }
+    }
+    return false;
+}
+
+void IRReplayEdgeSource::pump() {
+    int pushed = 0;
+    while (have_next) {
+        if (pushed >= IR_EDGE_RING / 2) {
+            return; // leave room, the rest of the burst goes with the next pump()
+        }
+        unsigned long last = next_time;
+        ir_edge_push(next_time, next_level);
+        pushed++;
+        clock = last;
+        have_next = next();
+        if (!have_next) {
+            clock = last + burst_gap_us * 10; // end of trace, let everything close
+        } else if ((next_time - last) >= burst_gap_us) {
+            clock = next_time - 1;
+            return;
+        }
+    }
+}
+
+IRSyntheticEdgeSource::IRSyntheticEdgeSource(unsigned long jitter_us, long skew_ppm, unsigned int glitch_permille,
+        long stretch_us) {
+    this->jitter_us = jitter_us;
+    this->skew_ppm = skew_ppm;
+    this->glitch_permille = glitch_permille;
+    this->stretch_us = stretch_us;
+    clock = 0;
+    count = 0;
+    air_us = 0;
+}
+
+unsigned long IRSyntheticEdgeSource::now() {
+    return clock;
+}
+
+// apply the transmitter skew, receiver lag and jitter to the queued frame
+void IRSyntheticEdgeSource::distort() {
+    for (int i = 0; i < count; i++) {
+        long t = (long)durations[i] + (long)durations[i] * skew_ppm / 1000000L;
+        t += (i % 2) ? -stretch_us : stretch_us; // marks come out long, the spaces after them short
+        if (jitter_us) {
+            t += (long)(rand() % (2 * jitter_us + 1)) - (long)jitter_us;
+        }
+        durations[i] = (t > 1) ? t : 1;
+        air_us += durations[i];
+    }
+}
+
+bool IRSyntheticEdgeSource::sendBytes(uint8_t data[], int len, uint8_t phy, uint8_t format) {
+    if (count) {
+        return false; // previous frame not delivered yet
+    }
+    count = ir_bytes_schedule(durations, data, len, phy, format);
+    distort();
+    return count != 0;
+}
+
+bool IRSyntheticEdgeSource::sendSymbols(const irsymbols_t *symbols) {
+    if (count) {
+        return false;
+    }
+    memcpy(durations, symbols->durations, symbols->count * sizeof(durations[0]));
+    count = symbols->count;
+    distort();
+    return true;
+}
+
+void IRSyntheticEdgeSource::pump() {
+    if (!count) {
+        return;
+    }
+    unsigned long t = clock + 10000; // idle line before the frame
+    for (int i = 0; i < count; i++) {
+        if (i % 2 == 0) {
+            ir_edge_push(t, MARK);
+        } else {
+            ir_edge_push(t, SPACE);
+            // spike in the middle of a space
+            if (glitch_permille && durations[i] > 300 && (unsigned int)(rand() % 1000) < glitch_permille) {
+                unsigned long spike = t + durations[i] / 2;
+                ir_edge_push(spike, MARK);
+                ir_edge_push(spike + 20 + rand() % 60, SPACE);
+            }
+        }
+        t += durations[i];
+    }
+    ir_edge_push(t, SPACE); // end of the trailing mark
+    clock = t + 20000; // idle line after the frame
+    count = 0;
+}
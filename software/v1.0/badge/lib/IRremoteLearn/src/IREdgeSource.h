@@ -0,0 +1,94 @@
+/*
+ * IRremoteLearn
+ *
+ * Edge sources feed IRrecv with (timestamp, level) pairs. The receiver pin
+ * interrupt is one of them, recorded traces and synthetic frames are the others
+ * so the capture and decoders can run against known input, on or off the device.
+ */
+
+#ifndef IREdgeSource_h
+#define IREdgeSource_h
+
+#include "Particle.h"
+#include "IRremoteLearn.h"
+#include <stdio.h>
+
+// Push one edge into the IRrecv capture ring, level is 0 for MARK and 1 for SPACE.
+// Safe from one producer at a time, interrupt or thread.
+// Returns false if the ring was full and the edge was dropped.
+bool ir_edge_push(unsigned long time_us, uint8_t level);
+
+// Where IRrecv gets its edges from, see IRrecv::setEdgeSource()
+class IREdgeSource
+{
+public:
+  virtual void begin(int rxpin) = 0;   // start delivering edges, called by IRrecv::enableIRIn()
+  virtual void end() = 0;              // stop delivering edges, called by IRrecv::disableIRIn()
+  virtual unsigned long now() = 0;     // current time in us, on the same clock as the edges
+  virtual void pump() {}               // called before the capture drains the ring, thread context
+};
+
+// Pin change interrupt on the receiver pin, the default source
+class IRGpioEdgeSource : public IREdgeSource
+{
+public:
+  static IRGpioEdgeSource &instance();
+  void begin(int rxpin);
+  void end();
+  unsigned long now();
+private:
+  IRGpioEdgeSource() : rxpin(-1) {}
+  int rxpin;
+};
+
+// Replays a recorded trace, one "<time_us> <level>" edge per line, '#' starts a comment.
+// Each pump() delivers the edges up to the next gap of burst_gap_us or more, then holds
+// the clock just short of the next edge so the capture sees the gap.
+class IRReplayEdgeSource : public IREdgeSource
+{
+public:
+  IRReplayEdgeSource(unsigned long burst_gap_us=10000);
+  bool open(const char *path);
+  void close();
+  bool done();                         // true once the whole trace was delivered
+  void begin(int rxpin) {}
+  void end() {}
+  unsigned long now();
+  void pump();
+private:
+  bool next();
+  FILE *file;
+  unsigned long burst_gap_us;
+  unsigned long clock;
+  unsigned long next_time;
+  uint8_t next_level;
+  bool have_next;
+};
+
+// Generates BYTES frames the way IRsend::sendBytes() sends them, with per-duration
+// jitter, transmitter clock skew, receiver mark stretch and spikes in the spaces,
+// on a virtual clock.
+class IRSyntheticEdgeSource : public IREdgeSource
+{
+public:
+  IRSyntheticEdgeSource(unsigned long jitter_us=0, long skew_ppm=0, unsigned int glitch_permille=0, long stretch_us=0);
+  bool sendBytes(uint8_t data[], int len, uint8_t phy=IR_PHY_NEC, uint8_t format=0); // queue one frame, delivered by the next pump()
+  bool sendSymbols(const irsymbols_t *symbols); // same for an IRsend::encodeBytes() frame
+  void begin(int rxpin) {}
+  void end() {}
+  unsigned long now();
+  void pump();
+  unsigned long airtime() { return air_us; } // micro seconds on air of the frames sent so far
+private:
+  void distort();
+  unsigned long jitter_us;
+  long skew_ppm;
+  unsigned int glitch_permille;
+  long stretch_us;
+  unsigned long clock;
+  uint16_t durations[IR_TX_SCHEDULE];
+  int count;
+  unsigned long air_us;
+};
+
+#endif // IREdgeSource_h
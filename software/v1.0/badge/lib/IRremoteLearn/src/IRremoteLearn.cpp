@@ -34,9 +34,13 @@
 
 #include "IRremoteLearn.h"
 #include "IRremoteLearnInt.h"
+#include "IREdgeSource.h"
+#include "IRtrace.h"
 
 volatile irparams_t irparams;
 
+static uint8_t ir_trace_buf[IR_TRACE_MAX(RAWBUF)]; // one record, see IRrecv::setTrace()
+
 // These versions of MATCH, MATCH_MARK, and MATCH_SPACE are only for debugging.
 // To use them, define DEBUG_IR in IRremoteLearnInt.h
 // Normally macros are used for efficiency
@@ -87,79 +91,508 @@ int MATCH_SPACE(int measured_ticks, int desired_us) {
 }
 #endif
 
-void memset_volatile(volatile void *s, uint8_t c, size_t n)
+uint8_t crc8(uint8_t data[], uint8_t len)
 {
-    volatile uint8_t* p = (uint8_t*)s;
-    while (n-- > 0) {
-        *p++ = c;
+    uint8_t cs = 0;
+
+    for ( int i = 0; i < len; i++ ) {
+        cs ^= data[i];
     }
+
+    return cs;
 }
 
-void memcpy_volatile(volatile void *d, volatile void *s, size_t n)
+// CRC-16/CCITT (poly 0x1021, MSB first) remainders by top byte, one lookup per byte
+static const uint16_t ir_crc16_table[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+    0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+    0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+    0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+    0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+    0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+    0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+    0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+    0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+    0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+    0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+    0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+    0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+    0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+    0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+    0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+    0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+    0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+    0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+    0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+    0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+    0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0
+};
+
+uint16_t crc16(const uint8_t data[], int len, uint16_t crc)
 {
-    // Serial.printf("Size: %lu", n);
-    volatile uint32_t* src = (uint32_t*)s;
-    volatile uint32_t* dest = (uint32_t*)d;
-    while (n-- > 0) {
-        *dest++ = *src++;
+    for (int i = 0; i < len; i++) {
+        crc = (crc << 8) ^ ir_crc16_table[(crc >> 8) ^ data[i]];
     }
+    return crc;
 }
 
-uint8_t crc8(uint8_t data[], uint8_t len)
-{
-    uint8_t cs = 0;
-
-    for ( int i = 0; i < len; i++ ) {
-        cs ^= data[i];
+// Hamming(8,4) code bytes by nibble: the nibble, three parity bits and an overall
+// parity bit. Any two are 4 bits apart, so one flipped bit is fixed and two are caught.
+static const uint8_t ir_hamming84[16] = {
+    0x00, 0x17, 0x2b, 0x3c, 0x4d, 0x5a, 0x66, 0x71, 0x8e, 0x99, 0xa5, 0xb2, 0xc3, 0xd4, 0xe8, 0xff
+};
+
+// Nibble sent as a Hamming(8,4) code byte, -1 if more than one bit flipped
+static int ir_hamming84_decode(uint8_t code, volatile uint8_t *corrected) {
+    for (int nibble = 0; nibble < 16; nibble++) {
+        uint8_t diff = code ^ ir_hamming84[nibble];
+        if (!(diff & (diff - 1))) {
+            if (diff) {
+                (*corrected)++;
+            }
+            return nibble;
+        }
     }
+    return -1;
+}
 
-    return cs;
+// CRC of a BYTES frame, 2 bytes with IR_FMT_CRC16 and 1 otherwise. Extended frames
+// fold in LENGTH and FORMAT, so a misread LENGTH can't pass DATA off as the CRC.
+static uint16_t ir_frame_check(uint8_t head, uint8_t format, uint8_t data[], int len) {
+    if (format & IR_FMT_CRC16) {
+        uint8_t framing[2] = { head, format };
+        return crc16(data, len, crc16(framing, 2));
+    }
+    uint8_t check = crc8(data, len);
+    if (head & IR_LEN_EXTENDED) {
+        check ^= head ^ format;
+    }
+    return check;
 }
 
-// prototype ISR handler
-void ir_recv_handler();
+// CRC bytes a BYTES frame of format ends with
+static int ir_frame_check_len(uint8_t format) {
+    return (format & IR_FMT_CRC16) ? 2 : 1;
+}
 
-void idle_timeout() {
-    irparams.rcvstate = STATE_STOP;
-    ir_recv_handler();
+// Start assembling a BYTES frame
+static void ir_bytes_reset(volatile irbytes_t *frame) {
+    frame->sent = 0;
+    frame->format = 0;
+    frame->len = 0;
+    frame->checks = 0;
+    frame->check = 0;
+    frame->half = false;
+    frame->broken = false;
+    frame->corrected = 0;
 }
 
-Timer idle_timer(irparams.mark_timout_us, idle_timeout, true); // one shot timer
+// Assemble a BYTES frame from its bytes as sent, DATA goes to rx[1] on. Returns STREAM_DATA
+// while more are due, then STREAM_DONE or STREAM_BAD_CRC, or STREAM_ERR if it can't be one.
+// A finished frame is left in rx as a plain one would be: LENGTH, DATA and the crc8() byte.
+static uint8_t ir_bytes_push(volatile irbytes_t *frame, volatile uint8_t *rx, uint8_t data) {
+    if (frame->sent++ == 0) {
+        int want = (data & IR_LEN_EXTENDED) ? (data & ~IR_LEN_EXTENDED) : data - 2;
+        if (want < 0 || want > RX_BUF_MAX - 2) {
+            return STREAM_ERR;
+        }
+        frame->head = data;
+        frame->want = want;
+        return STREAM_DATA;
+    }
+    if ((frame->head & IR_LEN_EXTENDED) && frame->sent == 2) {
+        int format = ir_hamming84_decode(data, &frame->corrected);
+        if (format < 0 || (format & ~IR_FMT_KNOWN)) {
+            return STREAM_ERR;
+        }
+        frame->format = format;
+        return STREAM_DATA;
+    }
+    if (frame->format & IR_FMT_FEC) {
+        if (!frame->half) {
+            frame->code = data;
+            frame->half = true;
+            return STREAM_DATA;
+        }
+        frame->half = false;
+        int high = ir_hamming84_decode(frame->code, &frame->corrected);
+        int low = ir_hamming84_decode(data, &frame->corrected);
+        if (high < 0 || low < 0) {
+            frame->broken = true; // keep counting bytes, the frame still ends where LENGTH says
+        }
+        data = (high << 4) | (low & 0x0F);
+    }
+    if (frame->len < frame->want) {
+        rx[1 + frame->len++] = data;
+        return STREAM_DATA;
+    }
+    frame->check = (frame->check << 8) | data; // MSB first
+    if (++frame->checks < ir_frame_check_len(frame->format)) {
+        return STREAM_DATA;
+    }
+
+    uint16_t check = ir_frame_check(frame->head, frame->format, (uint8_t *)&rx[1], frame->len);
+    rx[0] = frame->len + 2;
+    rx[frame->len + 1] = crc8((uint8_t *)&rx[1], frame->len);
+    return (frame->broken || check != frame->check) ? STREAM_BAD_CRC : STREAM_DONE;
+}
 
 /**
  * TIMING DIAGRAM
  *
  * HIGH
- * ~¯¯¯¯¯¯¯\__/¯¯\__/¯¯\__/¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯\__/¯¯\__/¯¯\__/¯¯¯¯(>irparams.idle_timout_us)¯¯¯¯¯~
+ * ~¯¯¯¯¯¯¯\__/¯¯\__/¯¯\__/¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯¯\__/¯¯\__/¯¯\__/¯¯¯¯(>irparams.capture_window_us)¯¯¯~
  * LOW     |              |                |              |
  * IDLE----|-----MARK-----|------SPACE-----|-----MARK-----|------IDLE--------------------------
  *
+ * Edge sources (see IREdgeSource.h) timestamp edges into irparams.edges, a single-producer/
+ * single-consumer ring. IRrecv::decode() drains the ring and runs the MARK/SPACE state
+ * machine below, so the receiver pin ISR stays constant time no matter how long the frame is.
  */
-void ir_recv_handler() {
-    // prevent re-entry
-    static bool active = false;
-    if (active) {
+
+// Start the BYTES stream decoder on a new frame
+static void ir_stream_reset() {
+    irparams.stream_state = STREAM_HDR;
+    irparams.stream_bits = 0;
+    irparams.stream_byte = 0;
+    ir_bytes_reset(&irparams.stream_bytes);
+}
+
+// True once the bytes LENGTH asked for are in, only the trailing mark is left
+static bool ir_stream_complete() {
+    return irparams.stream_state == STREAM_DONE || irparams.stream_state == STREAM_BAD_CRC;
+}
+
+// PHY of a BYTES header, -1 if it isn't one
+static int ir_bytes_header(unsigned int mark, unsigned int space) {
+    if (!MATCH_MARK(mark, NEC_HDR_MARK)) {
+        return -1;
+    }
+    if (MATCH_SPACE(space, NEC_HDR_SPACE)) {
+        return IR_PHY_NEC;
+    }
+    if (MATCH_SPACE(space, PPM4_HDR_SPACE)) {
+        return IR_PHY_PPM4;
+    }
+    return -1;
+}
+
+// MARK and SPACE durations a byte takes on phy
+static int ir_byte_entries(int phy) {
+    return (phy == IR_PHY_PPM4) ? 8 : 16;
+}
+
+// Measure the mark stretch and clock skew of a BYTES frame on its header pair. Skew
+// scales the mark and space alike and stretch moves time from one to the other, so
+// their sum gives the skew and what is left of the mark's excess over the space's
+// gives the stretch. Only what is past the deadbands is taken back from the bits.
+static void ir_bytes_calibrate(volatile ircal_t *cal, uint8_t phy, unsigned int mark, unsigned int space) {
+    long hdr_space = (phy == IR_PHY_PPM4) ? PPM4_HDR_SPACE : NEC_HDR_SPACE;
+    long nominal = NEC_HDR_MARK + hdr_space;
+    long measured = (long)mark + (long)space;
+    long skew_ppm = (long)((int64_t)(measured - nominal) * 1000000 / nominal);
+    long stretch_us = (((long)mark - NEC_HDR_MARK) - ((long)space - hdr_space)) / 2;
+    stretch_us -= (long)((int64_t)(NEC_HDR_MARK - hdr_space) * skew_ppm / 2000000); // skew's share of the difference
+    cal->stretch_us = stretch_us;
+    cal->skew_ppm = skew_ppm;
+    cal->shift_us = 0;
+    cal->scale = IR_CAL_ONE;
+    if (labs(stretch_us) > IR_CAL_STRETCH_DEADBAND && labs(stretch_us) <= IR_CAL_STRETCH_MAX) {
+        cal->shift_us = stretch_us;
+    }
+    if (labs(skew_ppm) > IR_CAL_SKEW_DEADBAND && labs(skew_ppm) <= IR_CAL_SKEW_MAX) {
+        cal->scale = nominal * IR_CAL_ONE / measured;
+    }
+}
+
+// IR_PHY_PPM4 mark positions are Gray coded, so a mark one position off flips a single bit
+static const uint8_t ir_ppm4_gray[4] = { 0, 1, 3, 2 };
+
+// Distance of a measured duration to the closer edge of its match window, negative outside
+static long ir_window_margin(long measured, long low, long high) {
+    return (measured - low < high - measured) ? measured - low : high - measured;
+}
+
+// Start measuring the link quality of a BYTES frame at its header pair
+static void ir_link_reset(volatile irlink_t *link, uint8_t phy, unsigned int mark, unsigned int space) {
+    int hdr_space = (phy == IR_PHY_PPM4) ? PPM4_HDR_SPACE : NEC_HDR_SPACE;
+    link->symbols = 0;
+    link->dev_sum_us = 0;
+    link->max_dev_us = 0;
+    link->marginal = 0;
+    long mark_margin = ir_window_margin(mark, TICKS_LOW(NEC_HDR_MARK + MARK_EXCESS), TICKS_HIGH(NEC_HDR_MARK + MARK_EXCESS));
+    long space_margin = ir_window_margin(space, TICKS_LOW(hdr_space - MARK_EXCESS), TICKS_HIGH(hdr_space - MARK_EXCESS));
+    link->header_margin_us = (mark_margin < space_margin) ? mark_margin : space_margin;
+}
+
+// Add a pair taken for symbol: how far it is from the symbol's ideal timing, and whether
+// that is more than half way to the threshold where it would be taken for another one.
+// The Gray code is its own inverse, so it gives back the IR_PHY_PPM4 mark position too.
+static void ir_link_add(volatile irlink_t *link, uint8_t phy, int symbol, unsigned int mark, unsigned int space) {
+    long dev, threshold;
+    if (phy == IR_PHY_PPM4) {
+        dev = (long)(mark + space) - (PPM4_BIT_MARK + PPM4_SPACE + ir_ppm4_gray[symbol] * PPM4_SPACE_STEP);
+        threshold = PPM4_SPACE_STEP / 2;
+    } else {
+        dev = (long)space - (symbol ? NEC_ONE_SPACE : NEC_ZERO_SPACE);
+        threshold = (NEC_ONE_SPACE - NEC_ZERO_SPACE) / 2;
+    }
+    dev = labs(dev);
+    link->symbols++;
+    link->dev_sum_us += dev;
+    if (dev > link->max_dev_us) {
+        link->max_dev_us = dev;
+    }
+    if (2 * dev > threshold) {
+        link->marginal++;
+    }
+}
+
+// Link quality of a frame, as decode_results reports it
+static void ir_link_quality(const volatile irlink_t *link, irquality_t *quality) {
+    quality->symbols = link->symbols;
+    quality->mean_dev_us = link->symbols ? link->dev_sum_us / link->symbols : 0;
+    quality->max_dev_us = link->max_dev_us;
+    quality->marginal = link->marginal;
+    quality->header_margin_us = link->header_margin_us;
+}
+
+static void ir_link_copy(volatile irlink_t *to, const volatile irlink_t *from) {
+    to->symbols = from->symbols;
+    to->dev_sum_us = from->dev_sum_us;
+    to->max_dev_us = from->max_dev_us;
+    to->marginal = from->marginal;
+    to->header_margin_us = from->header_margin_us;
+}
+
+// Bits sent by one BYTES MARK/SPACE pair on phy, -1 if the pair is out of spec.
+// In FEC coded bytes a pair a little out of spec gives the nearest symbol instead,
+// a wrong guess is one more flipped bit for the FEC to fix.
+static int ir_bytes_symbol_nominal(uint8_t phy, unsigned int mark, unsigned int space, bool coded) {
+    if (phy == IR_PHY_PPM4) {
+        // Mark to mark, so receiver lag stretching the mark into the space cancels out
+        if (!ir_match_window<PPM4_BIT_MARK / 2, PPM4_BIT_MARK * 2>(mark)) {
+            return -1;
+        }
+        int offset = (int)(mark + space) - (PPM4_BIT_MARK + PPM4_SPACE) + PPM4_SPACE_STEP / 2;
+        if (coded && offset < 0 && offset >= -PPM4_SPACE_STEP) {
+            offset = 0;
+        }
+        if (coded && offset >= 4 * PPM4_SPACE_STEP && offset < 5 * PPM4_SPACE_STEP) {
+            offset = 3 * PPM4_SPACE_STEP;
+        }
+        if (offset < 0 || offset >= 4 * PPM4_SPACE_STEP) {
+            return -1;
+        }
+        return ir_ppm4_gray[offset / PPM4_SPACE_STEP];
+    }
+    if (coded && ir_match_window<NEC_BIT_MARK / 2, NEC_BIT_MARK * 2>(mark) && space <= 2 * NEC_ONE_SPACE) {
+        return space >= (NEC_ZERO_SPACE + NEC_ONE_SPACE) / 2;
+    }
+    if (!MATCH_MARK(mark, NEC_BIT_MARK)) {
+        return -1;
+    }
+    if (MATCH_SPACE(space, NEC_ONE_SPACE)) {
+        return 1;
+    }
+    if (MATCH_SPACE(space, NEC_ZERO_SPACE)) {
+        return 0;
+    }
+    return -1;
+}
+
+// Same, with the pair first put back the way it was sent by the frame's calibration.
+// The header is a single pair, so its jitter can throw the calibration off by as much
+// as it corrects: a pair out of spec either way is tried as received too.
+// Pairs that give a symbol are added to the frame's link quality.
+static int ir_bytes_symbol(uint8_t phy, const volatile ircal_t *cal, volatile irlink_t *link,
+        unsigned int mark, unsigned int space, bool coded=false) {
+    int symbol = -1;
+    if (cal->shift_us || cal->scale != IR_CAL_ONE) {
+        long m = ((long)mark - cal->shift_us) * cal->scale / IR_CAL_ONE;
+        long s = ((long)space + cal->shift_us) * cal->scale / IR_CAL_ONE;
+        symbol = ir_bytes_symbol_nominal(phy, (m > 0) ? m : 0, (s > 0) ? s : 0, coded);
+        if (symbol >= 0) {
+            ir_link_add(link, phy, symbol, (m > 0) ? m : 0, (s > 0) ? s : 0);
+            return symbol;
+        }
+    }
+    symbol = ir_bytes_symbol_nominal(phy, mark, space, coded);
+    if (symbol >= 0) {
+        ir_link_add(link, phy, symbol, mark, space);
+    }
+    return symbol;
+}
+
+// Add the calibration of a BYTES frame that decoded to the irrecv_stats_t averages
+static void ir_calibration_count(const volatile ircal_t *cal) {
+    irparams.calibrated++;
+    irparams.stretch_us_sum += cal->stretch_us;
+    irparams.skew_ppm_sum += cal->skew_ppm;
+}
+
+// Decode a BYTES frame one MARK/SPACE pair at a time, as the capture saves them.
+// The LENGTH byte is checked as soon as it is in and fixes where the frame ends.
+// IR_FMT_FEC code bytes are corrected as they come in.
+static void ir_stream_pair(irraw_t mark, irraw_t space) {
+    volatile uint8_t *rx = IR_FRAME(irparams.frame_head).rx_data;
+    int phy;
+
+    switch (irparams.stream_state) {
+    case STREAM_HDR:
+        phy = ir_bytes_header(mark, space);
+        if (phy >= 0) {
+            ir_bytes_calibrate(&irparams.stream_cal, phy, mark, space);
+            ir_link_reset(&irparams.stream_link, phy, mark, space);
+            irparams.stream_phy = phy;
+            irparams.stream_state = STREAM_DATA;
+        } else {
+            irparams.stream_state = STREAM_ERR;
+        }
+        return;
+    case STREAM_DATA:
+        break;
+    default:
         return;
     }
-    active = true;
 
-    // irparams.current_time = System.ticks()/120; // optional hardware timer on Photon/P1/Electron
-    irparams.current_time = micros();
-    uint8_t irdata = (uint8_t)pinReadFast(irparams.rxpin);
+    bool coded = irparams.stream_bytes.format & IR_FMT_FEC;
+    int symbol = ir_bytes_symbol(irparams.stream_phy, &irparams.stream_cal, &irparams.stream_link, mark, space, coded);
+    if (symbol < 0) {
+        irparams.stream_state = STREAM_ERR;
+        return;
+    }
+    int bits = (irparams.stream_phy == IR_PHY_PPM4) ? 2 : 1;
+    irparams.stream_byte = (irparams.stream_byte << bits) | symbol;
+    irparams.stream_bits += bits;
+    if (irparams.stream_bits < 8) {
+        return;
+    }
+    irparams.stream_state = ir_bytes_push(&irparams.stream_bytes, rx, irparams.stream_byte);
+    irparams.stream_bits = 0;
+    irparams.stream_byte = 0;
+}
+
+// Start capturing a frame on the MARK edge at current_time
+static void ir_capture_start() {
+    ir_stream_reset();
+    irparams.rawlen = 0;
+    irparams.frame_time = irparams.current_time;
+    irparams.start_time = irparams.current_time;
+    irparams.end_time = irparams.current_time;
+    irparams.rcvstate = STATE_MARK;
+}
+
+// True, and counted, if the first mark of a frame can't be the start of a real one
+static bool ir_capture_reject(unsigned long mark_us) {
+    if (mark_us < irparams.min_pulse_us) {
+        irparams.glitches++;
+        return true;
+    }
+    if (irparams.require_header && !MATCH_MARK(mark_us, NEC_HDR_MARK)) {
+        irparams.headers_rejected++;
+        return true;
+    }
+    return false;
+}
+
+// True if a frame that started at time began while an async frame of ours went out,
+// so it is our own echo. Times are micros(), like the ones IRGpioEdgeSource takes.
+static bool ir_capture_echo(unsigned long time) {
+    if (!irparams.echo_suppress || !irparams.tx_frames) {
+        return false;
+    }
+    unsigned long end = irparams.tx_busy ? irparams.current_time : irparams.tx_end_time;
+    return time - irparams.tx_start_time <= end - irparams.tx_start_time;
+}
 
-    // Check for buffer overflow
-    if (irparams.rawlen >= RAWBUF) {
-        irparams.rcvstate = STATE_STOP;
+// Close the frame being captured and queue it for decode().
+// If the queue is full the frame is dropped and its slot reused.
+static void ir_capture_stop() {
+    volatile irframe_t *frame = &IR_FRAME(irparams.frame_head);
+    unsigned long mark_us = irparams.end_time - irparams.start_time;
+    frame->rawbuf[irparams.rawlen++] = ir_raw_pack(mark_us); // save last mark
+    // Serial.printlnf("%u", frame->rawbuf[irparams.rawlen-1]);
+    if (irparams.rawlen == 1 && ir_capture_reject(mark_us)) {
+        // a lone spike, nothing to queue
+    } else if (ir_capture_echo(irparams.frame_time)) {
+        irparams.echoes++; // our own frame, never worth decoding
+    } else if ((uint8_t)(irparams.frame_head - irparams.frame_tail) >= IR_FRAME_QUEUE - 1) {
+        irparams.frames_dropped++;
+    } else {
+        frame->rawlen = irparams.rawlen;
+        frame->rx_len = 0;
+        if (irparams.stream_state == STREAM_DONE) {
+            frame->rx_len = irparams.stream_bytes.len + 2;
+            irparams.fec_corrected += irparams.stream_bytes.corrected;
+            ir_calibration_count(&irparams.stream_cal);
+        }
+        frame->phy = irparams.stream_phy;
+        frame->format = irparams.stream_bytes.format;
+        frame->stretch_us = irparams.stream_cal.stretch_us;
+        frame->skew_ppm = irparams.stream_cal.skew_ppm;
+        ir_link_copy(&frame->link, &irparams.stream_link);
+        frame->seq = ++irparams.capture_seq;
+        frame->time = irparams.frame_time;
+        irparams.frame_head++; // queue it, decode() keeps working on the oldest frame
     }
+    irparams.rawlen = 0;
+    irparams.start_time = irparams.current_time;
+    irparams.end_time = irparams.current_time;
+    irparams.rcvstate = STATE_IDLE;
+}
+
+// True if the frame being captured is over at time now. That is once the LENGTH byte's
+// worth of bytes and the trailing mark are in, or the trailing mark of our own echo, or
+// at the latest when the capture window ends or the line has been idle for idle_gap_us,
+// depending on the end of frame mode. A reply right after our frame starts a new one.
+static bool ir_capture_due(unsigned long now) {
+    if (irparams.rcvstate != STATE_MARK) {
+        return false;
+    }
+    if (irparams.eof_mode == IR_EOF_WINDOW) {
+        if ((now - irparams.frame_time) >= irparams.capture_window_us) {
+            return true;
+        }
+    } else if ((now - irparams.last_edge_time) >= irparams.idle_gap_us) {
+        return true;
+    }
+    bool echo_over = !irparams.tx_busy && ir_capture_echo(irparams.frame_time);
+    return (ir_stream_complete() || echo_over) && irparams.end_time != irparams.start_time &&
+            (now - irparams.end_time) >= irparams.mark_timout_us;
+}
+
+// Run one edge from the ring through the capture state machine
+static void ir_capture_edge(uint32_t edge) {
+    irparams.current_time = edge & ~1UL;
+    uint8_t irdata = edge & 1;
+
+    // Close the frame once it is over, this edge starts the next one
+    if (ir_capture_due(irparams.current_time)) {
+        ir_capture_stop();
+    }
+
+    // Check for buffer overflow, leave room for the MARK/SPACE pair and the last mark
+    if (irparams.rawlen > RAWBUF - 3) {
+        ir_capture_stop();
+    }
+
+    volatile irraw_t *rawbuf = IR_FRAME(irparams.frame_head).rawbuf;
 
     switch (irparams.rcvstate) {
     case STATE_IDLE:
         if (irdata == MARK) {
-            irparams.rawlen = 0;
-            irparams.start_time = irparams.current_time;
-            irparams.end_time = irparams.current_time;
-            irparams.rcvstate = STATE_MARK;
-            idle_timer.startFromISR();
+            ir_capture_start();
         }
         break;
     case STATE_MARK: // SPACE handled here as well
@@ -167,45 +600,55 @@ void ir_recv_handler() {
             irparams.end_time = irparams.current_time;
         } else {
             if ((irparams.current_time - irparams.end_time) >= (irparams.mark_timout_us) ) {
+                unsigned long mark_us = irparams.end_time - irparams.start_time;
+                if (irparams.rawlen == 0 && ir_capture_reject(mark_us)) {
+                    ir_capture_start(); // nothing recorded yet, this MARK may be the real header
+                    break;
+                }
+                if (mark_us < irparams.min_pulse_us) {
+                    // fold the spike and the gap after it back into the last space, the
+                    // stream decoder already used that space so leave the frame to decodeBytes()
+                    irparams.glitches++;
+                    rawbuf[irparams.rawlen - 1] = ir_raw_pack(ir_raw_us(rawbuf[irparams.rawlen - 1]) +
+                            (irparams.current_time - irparams.start_time));
+                    irparams.stream_state = STREAM_ERR;
+                    irparams.start_time = irparams.current_time;
+                    irparams.end_time = irparams.current_time;
+                    break;
+                }
                 // save MARK
-                irparams.rawbuf1[irparams.rawlen++] = (irparams.end_time - irparams.start_time);
-                // Serial.printf("%lu,", irparams.rawbuf1[irparams.rawlen-1]);
+                rawbuf[irparams.rawlen++] = ir_raw_pack(mark_us);
+                // Serial.printf("%u,", rawbuf[irparams.rawlen-1]);
                 // pick out the SPACE timing
                 irparams.start_time = irparams.end_time; // MARK end is SPACE start
                 irparams.end_time = irparams.current_time; // current time is SPACE end
                 // save SPACE
-                irparams.rawbuf1[irparams.rawlen++] = (irparams.end_time - irparams.start_time);
-                // Serial.printf("%lu,", irparams.rawbuf1[irparams.rawlen-1]);
+                rawbuf[irparams.rawlen++] = ir_raw_pack(irparams.end_time - irparams.start_time);
+                // Serial.printf("%u,", rawbuf[irparams.rawlen-1]);
                 // reset timers
                 irparams.start_time = irparams.current_time;
                 irparams.end_time = irparams.current_time;
+                // decode the pair right away so the LENGTH byte can end the frame
+                ir_stream_pair(rawbuf[irparams.rawlen - 2], rawbuf[irparams.rawlen - 1]);
             }
         }
         break;
-    case STATE_STOP:
-        detachInterrupt(irparams.rxpin);
-        idle_timer.stopFromISR();
-        irparams.rawbuf1[irparams.rawlen++] = (irparams.end_time - irparams.start_time); // save last mark
-        // Serial.printlnf("%lu", irparams.rawbuf1[irparams.rawlen-1]);
-        memset_volatile(irparams.rawbuf2, 0, RAWBUF); // double buffer so we can decode while saving another capture
-        memcpy_volatile(&irparams.rawbuf2, &irparams.rawbuf1, irparams.rawlen);
-        memset_volatile(irparams.rawbuf1, 0, RAWBUF);
-        irparams.start_time = irparams.current_time;
-        irparams.end_time = irparams.current_time;
-        irparams.rcvstate = STATE_CAPTURED;
-        break;
     }
+    irparams.last_edge_time = irparams.current_time;
+}
 
-    if (irparams.blinkflag) {
-        if (irdata == MARK) {
-            BLINKLED_ON();  // turn pin D7 LED on
-        }
-        else {
-            BLINKLED_OFF(); // turn pin D7 LED off
-        }
+// Drain the edge ring into the frame queue, captures keep going
+// while decode() holds the oldest frame
+static void ir_capture_poll(IREdgeSource *source) {
+    source->pump();
+    while (irparams.edge_tail != irparams.edge_head) {
+        ir_capture_edge(irparams.edges[irparams.edge_tail]);
+        irparams.edge_tail = (irparams.edge_tail + 1) & (IR_EDGE_RING - 1);
+    }
+    // No more edges, close the frame once it is over
+    if (ir_capture_due(source->now())) {
+        ir_capture_stop();
     }
-
-    active = false;
 }
 
 void IRsend::sendNEC(unsigned long data, int nbits)
@@ -302,6 +745,275 @@ void IRsend::sendBytes(uint8_t data[], int len)
     // }
 }
 
+static int ir_byte_schedule(uint16_t *schedule, uint8_t data, uint8_t phy) {
+    if (phy == IR_PHY_PPM4) {
+        for (int i = 0; i < 4; i++) {
+            *schedule++ = PPM4_BIT_MARK;
+            *schedule++ = PPM4_SPACE + ir_ppm4_gray[data >> 6] * PPM4_SPACE_STEP;
+            data <<= 2;
+        }
+        return 8;
+    }
+    for (int i = 0; i < 8; i++) {
+        *schedule++ = NEC_BIT_MARK;
+        *schedule++ = (data & 0x80) ? NEC_ONE_SPACE : NEC_ZERO_SPACE;
+        data <<= 1;
+    }
+    return 16;
+}
+
+// A DATA or CRC byte, as two code bytes high nibble first with IR_FMT_FEC
+static int ir_body_schedule(uint16_t *schedule, uint8_t data, uint8_t phy, uint8_t format) {
+    if (!(format & IR_FMT_FEC)) {
+        return ir_byte_schedule(schedule, data, phy);
+    }
+    int n = ir_byte_schedule(schedule, ir_hamming84[data >> 4], phy);
+    return n + ir_byte_schedule(schedule + n, ir_hamming84[data & 0x0F], phy);
+}
+
+int ir_bytes_schedule(uint16_t *schedule, uint8_t data[], int len, uint8_t phy, uint8_t format) {
+    if (len < 0 || len > TX_BUF_MAX || (format & ~IR_FMT_KNOWN)) {
+        return 0;
+    }
+    if ((format & IR_FMT_FEC) && phy != IR_PHY_PPM4) {
+        return 0; // coded NEC frames of a game message outlast the capture window
+    }
+    // header, LENGTH, FORMAT, DATA and check bytes, trailing mark: check it fits before writing
+    int body = (len + ir_frame_check_len(format)) * ((format & IR_FMT_FEC) ? 2 : 1);
+    int total = 2 + ir_byte_entries(phy) * (1 + (format ? 1 : 0) + body) + 1;
+    if (total > IR_TX_SCHEDULE || (format && total >= RAWBUF)) {
+        return 0;
+    }
+    uint8_t head = format ? (IR_LEN_EXTENDED | len) : len + 2;
+    int n = 0;
+    schedule[n++] = NEC_HDR_MARK;
+    schedule[n++] = (phy == IR_PHY_PPM4) ? PPM4_HDR_SPACE : NEC_HDR_SPACE;
+    n += ir_byte_schedule(schedule + n, head, phy);
+    if (format) {
+        n += ir_byte_schedule(schedule + n, ir_hamming84[format], phy);
+    }
+    for (int x = 0; x < len; x++) {
+        n += ir_body_schedule(schedule + n, data[x], phy, format);
+    }
+    uint16_t check = ir_frame_check(head, format, data, len);
+    if (ir_frame_check_len(format) == 2) {
+        n += ir_body_schedule(schedule + n, check >> 8, phy, format);
+    }
+    n += ir_body_schedule(schedule + n, check, phy, format);
+    schedule[n++] = (phy == IR_PHY_PPM4) ? PPM4_BIT_MARK : NEC_BIT_MARK; // trailing mark ends the last space
+    return n;
+}
+
+static irsymbols_t ir_symbol_pool[IR_SYMBOL_POOL]; // frames handed out by encodeBytes()
+static irsymbols_t ir_send_bytes_frame;            // sendBytesAsync() frame, guarded by busy()
+
+// Busy-wait until deadline, then switch the carrier on or off
+static void ir_send_edge(unsigned long deadline, bool on) {
+    long left = (long)(deadline - micros());
+    if (left > 0) {
+        delayMicroseconds(left);
+    }
+    analogWrite(irparams.txpin, on ? 128 : 0, irparams.irout_khz * 1000);
+}
+
+// Play symbols on the TX pin. Every edge is timed from the start of the frame, so a late
+// wakeup doesn't stretch the rest of it. With sleep, the whole OS ticks of a wait are
+// slept so loop() gets the CPU, and the rest is busy-waited with thread switching held
+// off, as the scheduler would hand loop() a whole tick.
+static void ir_send_play(const irsymbols_t *symbols, bool sleep) {
+    unsigned long deadline = micros();
+    for (int i = 0; i <= symbols->count; i++) {
+        bool on = i < symbols->count && i % 2 == 0; // carrier off after the trailing mark
+        if (i) {
+            deadline += symbols->durations[i - 1];
+        }
+        if (!sleep) {
+            ir_send_edge(deadline, on);
+            continue;
+        }
+        unsigned long ms = ir_send_sleep_ms((long)(deadline - micros()));
+        if (ms) {
+            delay(ms);
+        }
+        SINGLE_THREADED_BLOCK() {
+            ir_send_edge(deadline, on);
+        }
+    }
+}
+
+// Wait us, sleeping through the whole milliseconds
+static void ir_send_wait(unsigned long us) {
+    delay(us / 1000);
+    delayMicroseconds(us % 1000);
+}
+
+// Listen before talk: back off a random time, in a window that doubles every time,
+// while the receiver heard something lately. Badges that collided pick different
+// waits, so they don't collide again.
+static void ir_send_sense(IRrecv *receiver) {
+    for (int tries = 0; !receiver->idle(irparams.csma_quiet_us); tries++) {
+        if (tries == IR_CSMA_MAX_TRIES) {
+            irparams.tx_forced++;
+            break;
+        }
+        if (tries == 0) {
+            irparams.tx_deferred++;
+        }
+        unsigned long wait_us = (unsigned long)rand() % (irparams.csma_slot_us << tries);
+        irparams.tx_backoffs++;
+        irparams.tx_backoff_us += wait_us;
+        ir_send_wait(wait_us);
+    }
+}
+
+// Right before an async frame plays. Without echo suppression the receiver is
+// turned off, deaf to our own frame until the application turns it back on.
+static void ir_send_begin() {
+    IRrecv *receiver = irparams.csma_receiver;
+    if (receiver) {
+        ir_send_sense(receiver);
+        if (!irparams.echo_suppress) {
+            receiver->disableIRIn();
+        }
+    }
+    irparams.tx_start_time = micros(); // frames that start from here on are our echo
+}
+
+static void ir_send_finish() {
+    irsend_done_t done = irparams.tx_done;
+    irparams.tx_end_time = micros();
+    irparams.tx_busy = false; // before the callback, so it may send the next frame
+    if (done) {
+        done();
+    }
+}
+
+#if PLATFORM_THREADING
+// Particle devices don't give applications a timer interrupt, so the schedule is
+// walked by a thread at the application priority that blocks between frames.
+static os_thread_t ir_send_thread = NULL;
+static os_semaphore_t ir_send_start = NULL;
+
+static void ir_send_thread_fn(void *param) {
+    while (true) {
+        os_semaphore_take(ir_send_start, CONCURRENT_WAIT_FOREVER, false);
+        ir_send_begin();
+        ir_send_play(irparams.tx_symbols, true);
+        ir_send_finish();
+    }
+}
+#endif // PLATFORM_THREADING
+
+/* Encode a BYTES frame once, with its LENGTH and CRC bytes, for sendSymbols() */
+/* and sendSymbolsAsync() to replay as often as needed without touching data again. */
+/* phy is IR_PHY_NEC, or IR_PHY_PPM4 for peers known to decode it. */
+/* format is 0, or IR_FMT_* flags for peers known to decode them. */
+/* IR_FMT_FEC doubles the DATA and CRC bytes on air and is only sent on IR_PHY_PPM4, */
+/* 29 DATA bytes fit a receiver, one less with IR_FMT_CRC16. */
+/* Returns NULL if the frame is too long, IR_FMT_FEC is asked for on IR_PHY_NEC or */
+/* all IR_SYMBOL_POOL frames are taken. */
+const irsymbols_t *IRsend::encodeBytes(uint8_t data[], int len, uint8_t phy, uint8_t format)
+{
+    for (int i = 0; i < IR_SYMBOL_POOL; i++) {
+        irsymbols_t *symbols = &ir_symbol_pool[i];
+        if (!symbols->in_use) {
+            symbols->count = ir_bytes_schedule(symbols->durations, data, len, phy, format);
+            if (!symbols->count) {
+                return NULL;
+            }
+            symbols->in_use = true;
+            return symbols;
+        }
+    }
+    return NULL;
+}
+
+/* Give an encodeBytes() frame back to the pool, not while it is being sent */
+bool IRsend::release(const irsymbols_t *symbols)
+{
+    if (!symbols || (irparams.tx_busy && irparams.tx_symbols == symbols)) {
+        return false;
+    }
+    ((irsymbols_t *)symbols)->in_use = false;
+    return true;
+}
+
+void IRsend::sendSymbols(const irsymbols_t *symbols)
+{
+    ir_send_play(symbols, false);
+}
+
+/* Start sending an encoded frame and return right away. */
+/* busy() stays TRUE until it is out, then done is called if given. */
+/* The transmit thread holds the scheduler for every edge, so loop() only runs in the */
+/* whole ticks of long spaces: about 2% of an IR_PHY_NEC frame, it doesn't free loop(). */
+/* Returns FALSE if the previous frame is still going out. */
+bool IRsend::sendSymbolsAsync(const irsymbols_t *symbols, irsend_done_t done)
+{
+    if (irparams.tx_busy || !symbols || !symbols->count) {
+        return false;
+    }
+#if PLATFORM_THREADING
+    if (!ir_send_thread) {
+        if (os_semaphore_create(&ir_send_start, 1, 0) ||
+                os_thread_create(&ir_send_thread, "irsend", IR_TX_PRIORITY, ir_send_thread_fn, NULL, IR_TX_STACK)) {
+            ir_send_thread = NULL;
+            return false;
+        }
+    }
+#endif
+    irparams.tx_symbols = symbols;
+    irparams.tx_done = done;
+    irparams.tx_busy = true;
+    irparams.tx_frames++;
+#if PLATFORM_THREADING
+    os_semaphore_give(ir_send_start, false);
+#else
+    ir_send_begin(); // no threads, send it in place
+    ir_send_play(symbols, true);
+    ir_send_finish();
+#endif
+    return true;
+}
+
+/* Start sending a BYTES frame like sendBytes() and return right away, see sendSymbolsAsync() */
+bool IRsend::sendBytesAsync(uint8_t data[], int len, irsend_done_t done)
+{
+    if (irparams.tx_busy) {
+        return false;
+    }
+    ir_send_bytes_frame.count = ir_bytes_schedule(ir_send_bytes_frame.durations, data, len);
+    return sendSymbolsAsync(&ir_send_bytes_frame, done);
+}
+
+bool IRsend::busy()
+{
+    return irparams.tx_busy;
+}
+
+/* Listen before talk for sendSymbolsAsync() and sendBytesAsync(): wait until receiver */
+/* heard nothing for quiet_us, backing off a random time in a window of slot_us that */
+/* doubles every time, up to IR_CSMA_MAX_TRIES times, then send anyway. Unless it */
+/* suppresses echoes (see IRrecv::setEchoSuppression()), the receiver is turned off */
+/* right before the frame goes out, turn it back on once busy() is FALSE. */
+/* NULL sends blindly, the default. */
+void IRsend::setCarrierSense(IRrecv *receiver, unsigned long quiet_us, unsigned long slot_us)
+{
+    irparams.csma_receiver = receiver;
+    irparams.csma_quiet_us = quiet_us;
+    irparams.csma_slot_us = slot_us;
+}
+
+/* Snapshot of the transmitter counters */
+void IRsend::stats(irsend_stats_t *stats)
+{
+    stats->frames = irparams.tx_frames;
+    stats->deferred = irparams.tx_deferred;
+    stats->backoffs = irparams.tx_backoffs;
+    stats->forced = irparams.tx_forced;
+    stats->backoff_us = irparams.tx_backoff_us;
+}
+
 void IRsend::sendSony(unsigned long data, int nbits) {
     enableIROut(38);
     mark(SONY_HDR_MARK);
@@ -483,23 +1195,28 @@ IRrecv::IRrecv(int rxpin, unsigned long idle_timout_ms, unsigned long mark_timou
     irparams.rxpin = rxpin;
     irparams.idle_timout_ms = idle_timout_ms;
     irparams.mark_timout_us = mark_timout_us;
+    irparams.capture_window_us = mark_timout_us * 1000UL; // was the one-shot idle_timer period, in ms
+    irparams.eof_mode = IR_EOF_WINDOW;
+    source = &IRGpioEdgeSource::instance();
+    trace_out = NULL;
+    trace_seq = 0;
+    peer_offset = -1;
+    link_seq = 0;
+    memset(peers, 0, sizeof(peers));
     irparams.blinkflag = 0;
 }
 
 // initialization
 void IRrecv::enableIRIn() {
-    // set pin modes
-    pinMode(irparams.rxpin, INPUT);
-
-    // enable and reset ir_recv_handler for Learner style IR receivers such as the Vishay TSMP58000
-    // http://www.vishay.com/docs/82485/tsmp58000.pdf
-    resume();
+    irparams.edge_tail = irparams.edge_head; // discard stale edges, frames already queued are kept
+    irparams.rcvstate = STATE_IDLE;
+    irparams.rawlen = 0;
+    source->begin(irparams.rxpin);
 }
 
 // initialization
 void IRrecv::disableIRIn() {
-    detachInterrupt(irparams.rxpin);
-    idle_timer.stop();
+    source->end();
 }
 
 // enable/disable blinking of pin 13 on IR processing
@@ -512,25 +1229,221 @@ void IRrecv::blink13(int blinkflag)
 }
 
 
+// Take edges from another source than the receiver pin, e.g. a recorded trace.
+// Call it while the receiver is disabled.
+void IRrecv::setEdgeSource(IREdgeSource *source) {
+    this->source = source;
+}
+
+// Write a binary record of every captured frame to out (see IRtrace.h for the format),
+// with the decode outcome, the first time decode() sees it. NULL turns it off.
+// Records are written from decode(), never the ISR. For USB serial call
+// Serial.blockOnOverrun(false) so a host that isn't reading drops records instead of
+// stalling the loop, the reader resyncs on the next record.
+void IRrecv::setTrace(Print *out) {
+    trace_out = out;
+}
+
+// Keep counters per peer for BYTES frames that carry the sender's 32-bit ID at offset
+// in rx_data, -1 (the default) to turn them off. Peers come in with the first frame
+// that decodes, CRC failures and decode errors only count for peers already in: the ID
+// of a frame that failed may be broken too.
+void IRrecv::setPeerId(int offset) {
+    peer_offset = offset;
+    memset(peers, 0, sizeof(peers));
+}
+
+// Counters of the peer with this ID, false if it isn't in the table
+bool IRrecv::peerStats(uint32_t id, irpeer_stats_t *stats) {
+    irpeer_stats_t *peer = findPeer(id, false);
+    if (!peer) {
+        return false;
+    }
+    *stats = *peer;
+    return true;
+}
+
+// One line per peer in the table, to a Serial port or the like
+void IRrecv::dumpPeers(Print *out) {
+    char line[160];
+    for (int i = 0; i < IR_PEER_TABLE; i++) {
+        irpeer_stats_t *peer = &peers[i];
+        if (!peer->frames) {
+            continue;
+        }
+        int len = snprintf(line, sizeof(line), "IR peer %08lx frames:%lu crc:%lu errors:%lu dev:%uus max:%uus "
+                "marginal:%u.%u%% header:%dus seen:%lums ago\r\n", (unsigned long)peer->id, peer->frames,
+                peer->crc_failures, peer->decode_errors, peer->mean_dev_us, peer->max_dev_us,
+                peer->marginal_permille / 10, peer->marginal_permille % 10, peer->header_margin_us,
+                millis() - peer->last_ms);
+        if (len > (int)sizeof(line) - 1) {
+            len = sizeof(line) - 1;
+        }
+        out->write((const uint8_t *)line, len);
+    }
+}
+
+// Table entry of the peer with this ID. With add, a peer that isn't in takes a free
+// entry, or the one heard from longest ago.
+irpeer_stats_t *IRrecv::findPeer(uint32_t id, bool add) {
+    irpeer_stats_t *oldest = &peers[0];
+    for (int i = 0; i < IR_PEER_TABLE; i++) {
+        if (peers[i].frames && peers[i].id == id) {
+            return &peers[i];
+        }
+        if (!peers[i].frames) {
+            oldest = &peers[i];
+        } else if (oldest->frames && (long)(peers[i].last_ms - oldest->last_ms) < 0) {
+            oldest = &peers[i];
+        }
+    }
+    if (!add) {
+        return NULL;
+    }
+    memset(oldest, 0, sizeof(*oldest));
+    oldest->id = id;
+    return oldest;
+}
+
+// Count a BYTES frame with the first data_len DATA bytes in rx_data, once per frame
+// however often decode() hands it out
+void IRrecv::countLink(decode_results *results, uint8_t outcome, int data_len) {
+    if (results->seq == link_seq) {
+        return;
+    }
+    link_seq = results->seq;
+    if (outcome == IR_LINK_CRC) {
+        irparams.crc_failures++;
+    } else if (outcome == IR_LINK_DECODE) {
+        irparams.decode_errors++;
+    }
+    if (peer_offset < 1 || data_len < peer_offset - 1 + 4) {
+        return; // no sender ID, or not that far
+    }
+    uint32_t id;
+    memcpy(&id, &results->rx_data[peer_offset], 4);
+    irpeer_stats_t *peer = findPeer(id, outcome == IR_LINK_FRAME);
+    if (!peer) {
+        return;
+    }
+    peer->last_ms = millis();
+    if (outcome == IR_LINK_CRC) {
+        peer->crc_failures++;
+        return;
+    }
+    if (outcome == IR_LINK_DECODE) {
+        peer->decode_errors++;
+        return;
+    }
+    const irquality_t *quality = &results->quality;
+    int marginal_permille = quality->symbols ? quality->marginal * 1000 / quality->symbols : 0;
+    if (peer->frames++ == 0) {
+        peer->mean_dev_us = quality->mean_dev_us;
+        peer->max_dev_us = quality->max_dev_us;
+        peer->marginal_permille = marginal_permille;
+        peer->header_margin_us = quality->header_margin_us;
+        return;
+    }
+    peer->mean_dev_us += ((int)quality->mean_dev_us - (int)peer->mean_dev_us) / 8;
+    peer->max_dev_us += ((int)quality->max_dev_us - (int)peer->max_dev_us) / 8;
+    peer->marginal_permille += (marginal_permille - (int)peer->marginal_permille) / 8;
+    peer->header_margin_us += ((int)quality->header_margin_us - (int)peer->header_margin_us) / 8;
+}
+
+// Choose how a frame that the LENGTH byte can't close is ended:
+// IR_EOF_WINDOW closes it a fixed window after its first MARK, as the old idle Timer did.
+// IR_EOF_IDLE closes it once no edge came for idle_gap_us, checked against the edge
+// source clock in decode().
+void IRrecv::setEndOfFrame(uint8_t mode, unsigned long idle_gap_us) {
+    irparams.idle_gap_us = idle_gap_us;
+    irparams.eof_mode = mode;
+}
+
+// Drop the frame decode() handed out and move on to the next queued one. The
+// interrupt stays attached and frames that arrived meanwhile are already queued.
 void IRrecv::resume() {
-    irparams.rcvstate = STATE_IDLE;
-    irparams.rawlen = 0;
-    attachInterrupt(irparams.rxpin, ir_recv_handler, CHANGE);
+    if (irparams.frame_tail != irparams.frame_head) {
+        irparams.frame_tail++;
+    }
+}
+
+// True if no edge came for quiet_us, queued or not, so the line is free to send on
+bool IRrecv::idle(unsigned long quiet_us) {
+    unsigned long last = irparams.last_edge_time;
+    uint16_t head = irparams.edge_head;
+    if (head != irparams.edge_tail) {
+        last = irparams.edges[(uint16_t)(head - 1) & (IR_EDGE_RING - 1)] & ~1UL;
+    }
+    return (source->now() - last) >= quiet_us;
+}
+
+// Snapshot of the receiver counters
+void IRrecv::stats(irrecv_stats_t *stats) {
+    stats->frames = irparams.capture_seq;
+    stats->frames_dropped = irparams.frames_dropped;
+    stats->edges_dropped = irparams.edge_overflows;
+    stats->glitches = irparams.glitches;
+    stats->headers_rejected = irparams.headers_rejected;
+    stats->fec_corrected = irparams.fec_corrected;
+    stats->echoes = irparams.echoes;
+    stats->calibrated = irparams.calibrated;
+    stats->crc_failures = irparams.crc_failures;
+    stats->decode_errors = irparams.decode_errors;
+    stats->stretch_us_avg = 0;
+    stats->skew_ppm_avg = 0;
+    if (irparams.calibrated) {
+        stats->stretch_us_avg = irparams.stretch_us_sum / (long)irparams.calibrated;
+        stats->skew_ppm_avg = irparams.skew_ppm_sum / (long long)irparams.calibrated;
+    }
+}
+
+// Keep capturing while IRsend sends async frames. Frames that start while one goes out
+// are our own echo, dropped as soon as it is over and counted in irrecv_stats_t::echoes,
+// so a reply that starts right after our trailing mark is captured.
+void IRrecv::setEchoSuppression(bool on) {
+    irparams.echo_suppress = on;
+}
+
+// Reject marks shorter than min_pulse_us (0 turns it off) and, with require_header,
+// anything that doesn't start with a BYTES header mark. Spikes that start a capture
+// are dropped as soon as they end, so they never hold up the frame that follows.
+void IRrecv::setGlitchFilter(unsigned long min_pulse_us, bool require_header) {
+    irparams.min_pulse_us = min_pulse_us;
+    irparams.require_header = require_header;
 }
 
 // Decodes the received IR message
 // Returns 0 if no data ready, 1 if data ready.
 // Results of decoding are stored in results
 int IRrecv::decode(decode_results *results) {
-    results->rawbuf = irparams.rawbuf2;
-    results->rawlen = irparams.rawlen;
-    if (irparams.rcvstate != STATE_CAPTURED) {
+    ir_capture_poll(source);
+    if (irparams.frame_tail == irparams.frame_head) {
         return ERR;
     }
+    volatile irframe_t *frame = &IR_FRAME(irparams.frame_tail);
+    results->rawbuf = frame->rawbuf;
+    results->rawlen = frame->rawlen;
+    results->seq = frame->seq;
 
+    int rv = decodeFrame(results);
+    if (trace_out && trace_seq != results->seq) {
+        trace_seq = results->seq; // once per frame, decode() hands it out until resume()
+        irtrace_t trace = { (uint32_t)frame->time, (uint32_t)frame->seq, (uint16_t)frame->rawlen,
+                (uint8_t)rv, (int8_t)((rv == DECODED) ? results->decode_type : PROTOCOL_UNKNOWN) };
+        size_t len = ir_trace_encode(ir_trace_buf, sizeof(ir_trace_buf), &trace, frame->rawbuf);
+        trace_out->write(ir_trace_buf, len);
+    }
+    if (rv == ERR) {
+        resume(); // Throw away and start over
+    }
+    return rv;
+}
+
+// Run the decoders over the frame decode() picked
+int IRrecv::decodeFrame(decode_results *results) {
     // For debugging when there is no match
     // for (int i = 0; i < results->rawlen; i++) {
-    //   Serial.printf("%s%lu,", (i%2)?"-":"",results->rawbuf[i]);
+    //   Serial.printf("%s%lu,", (i%2)?"-":"",ir_raw_us(results->rawbuf[i]));
     // }
     // Serial.println();
 
@@ -541,6 +1454,10 @@ int IRrecv::decode(decode_results *results) {
 //         return DECODED;
 //     }
 
+    if (decodeStream(results)) {
+        return DECODED;
+    }
+
 #ifdef DEBUG_IR
     Serial.println("Attempting BYTES decode");
 #endif
@@ -611,8 +1528,6 @@ int IRrecv::decode(decode_results *results) {
     //     return DECODED;
     // }
 
-    // Throw away and start over
-    resume();
     return ERR;
 }
 
@@ -649,7 +1564,7 @@ long IRrecv::decodeDisney(decode_results *results) {
     for (int i = 0; i < results->rawlen; i++) {
         // Skip over junk data
         // TODO: Fix ir_recv_handler sometimes returns [12,-UINT_MAX,...,...]
-        if (results->rawbuf[i] < 50 || results->rawbuf[i] > 500000) {
+        if (results->rawbuf[i] < 50 || ir_raw_us(results->rawbuf[i]) > 500000) {
             continue;
         }
 
@@ -746,24 +1661,72 @@ long IRrecv::decodeDisney(decode_results *results) {
     return DECODED;
 }
 
+// BYTES frames already decoded by the stream decoder while they were captured
+long IRrecv::decodeStream(decode_results *results) {
+    volatile irframe_t *frame = &IR_FRAME(irparams.frame_tail);
+    if (frame->rx_len == 0) {
+        return ERR;
+    }
+    results->rx_len = frame->rx_len;
+    for (int i = 0; i < results->rx_len; i++) {
+        results->rx_data[i] = frame->rx_data[i];
+    }
+    results->phy = frame->phy;
+    results->format = frame->format;
+    results->stretch_us = frame->stretch_us;
+    results->skew_ppm = frame->skew_ppm;
+    ir_link_quality(&frame->link, &results->quality);
+    results->value = 0;
+    results->bits = results->rx_len * 8;
+    results->decode_type = BYTES;
+    countLink(results, IR_LINK_FRAME, results->rx_len - 2);
+    return DECODED;
+}
+
+// Next byte as sent from the rawbuf pairs at *offset, -1 if they run out or are out of spec
+static int ir_rawbuf_byte(decode_results *results, int phy, const ircal_t *cal, irlink_t *link, bool coded,
+        int *offset) {
+    int bits = (phy == IR_PHY_PPM4) ? 2 : 1;
+    int data = 0;
+    for (int y = 0; y < 8; y += bits) {
+        if (*offset + 1 >= (int)results->rawlen) {
+            return -1;
+        }
+        int symbol = ir_bytes_symbol(phy, cal, link, results->rawbuf[*offset], results->rawbuf[*offset + 1], coded);
+        if (symbol < 0) {
+            return -1;
+        }
+        data = (data << bits) | symbol;
+        *offset += 2;
+    }
+    return data;
+}
+
 // NECs have a repeat only 4 items long
 long IRrecv::decodeBytes(decode_results *results) {
-    uint8_t data = 0;
     int offset = 0; // Skip first space
     results->rx_len = 0;
 
-    // Require at least 6 samples to prevent triggering on noise
-    if (results->rawlen < 80) {
-        // Serial.printlnf("ERR 1: %d", results->rawlen);
+    // IR HEADER capture START
+    // Initial mark and space, the space tells the PHY and the timing calibration
+    if (results->rawlen < 2) {
         return ERR;
     }
-
-    // IR HEADER capture START
-    // Initial mark
-    if (!MATCH_MARK(results->rawbuf[offset], NEC_HDR_MARK)) {
+    int phy = ir_bytes_header(results->rawbuf[offset], results->rawbuf[offset + 1]);
+    if (phy < 0) {
         // Serial.println("ERR 2");
         return ERR;
     }
+
+    // Require as many bytes as IR_BYTES_MIN_RAWLEN holds on IR_PHY_NEC to prevent triggering on noise
+    if (results->rawlen < 2 + (IR_BYTES_MIN_RAWLEN - 2) * ir_byte_entries(phy) / ir_byte_entries(IR_PHY_NEC)) {
+        // Serial.printlnf("ERR 1: %d", results->rawlen);
+        return ERR;
+    }
+    ircal_t cal;
+    ir_bytes_calibrate(&cal, phy, results->rawbuf[offset], results->rawbuf[offset + 1]);
+    irlink_t link;
+    ir_link_reset(&link, phy, results->rawbuf[offset], results->rawbuf[offset + 1]);
     offset++;
     // // Check for repeat
     // if (irparams.rawlen == 4 &&
@@ -778,60 +1741,43 @@ long IRrecv::decodeBytes(decode_results *results) {
     //     return ERR;
     // }
 
-    // Initial space
-    if (!MATCH_SPACE(results->rawbuf[offset], NEC_HDR_SPACE)) {
-        // Serial.println("ERR 3");
-        return ERR;
-    }
     offset++;
     // IR HEADER capture END
 
-    // Receive LEN, DATA, and CRC
-    int total_len = ((results->rawlen - offset - 1)/8/2);
-    // Serial.printlnf("TOTAL LEN:%d", total_len);
-    for (int x = 0; x < total_len; x++) {
-        for (int y = 0; y < 8; y++) {
-            if (!MATCH_MARK(results->rawbuf[offset], NEC_BIT_MARK)) {
-                // Serial.println("ERR 4");
-                return ERR;
-            }
-            offset++;
-            if (MATCH_SPACE(results->rawbuf[offset], NEC_ONE_SPACE)) {
-                data = (data << 1) | 1;
-            }
-            else if (MATCH_SPACE(results->rawbuf[offset], NEC_ZERO_SPACE)) {
-                data <<= 1;
-            }
-            else {
-                // Serial.println("ERR 5");
-                return ERR;
-            }
-            offset++;
+    // Receive LENGTH, then the bytes it asks for, anything after them is the next frame
+    irbytes_t frame;
+    ir_bytes_reset(&frame);
+    uint8_t state = STREAM_DATA;
+    while (state == STREAM_DATA) {
+        int data = ir_rawbuf_byte(results, phy, &cal, &link, frame.format & IR_FMT_FEC, &offset);
+        if (data < 0) {
+            // Serial.println("ERR 4");
+            countLink(results, IR_LINK_DECODE, frame.len);
+            return ERR;
         }
-        results->rx_data[results->rx_len++] = data;
-        // if (x == 0) {
-        //     Serial.printf("LEN:%d,", data);
-        // }
-        // else {
-        //     Serial.printf("%02x,", data);
-        // }
-        data = 0;
+        state = ir_bytes_push(&frame, results->rx_data, data);
     }
-    // Serial.println("");
 
     // Validate CRC
-    uint8_t len = results->rx_data[0];
-    uint8_t crc_sent = results->rx_data[len-1];
-    uint8_t crc_bytes = crc8(&results->rx_data[1], len-2);
-    if (crc_bytes != crc_sent) {
-        // Serial.printlnf("Bad CRC! sent:%02x calc:%02x", crc_sent, crc_bytes);
+    if (state != STREAM_DONE) {
+        // Serial.println("Bad CRC!");
+        countLink(results, (state == STREAM_BAD_CRC) ? IR_LINK_CRC : IR_LINK_DECODE, frame.len);
         return ERR;
     }
+    results->rx_len = frame.len + 2;
+    irparams.fec_corrected += frame.corrected;
+    ir_calibration_count(&cal);
 
     // Success
     results->value = 0;
     results->bits = results->rx_len * 8;
     results->decode_type = BYTES;
+    results->phy = phy;
+    results->format = frame.format;
+    results->stretch_us = cal.stretch_us;
+    results->skew_ppm = cal.skew_ppm;
+    ir_link_quality(&link, &results->quality);
+    countLink(results, IR_LINK_FRAME, frame.len);
     return DECODED;
 }
 
@@ -845,7 +1791,7 @@ long IRrecv::decodeNEC(decode_results *results) {
     }
     offset++;
     // Check for repeat
-    if (irparams.rawlen == 4 &&
+    if (results->rawlen == 4 &&
             MATCH_SPACE(results->rawbuf[offset], NEC_RPT_SPACE) &&
             MATCH_MARK(results->rawbuf[offset + 1], NEC_BIT_MARK)) {
         results->bits = 0;
@@ -853,7 +1799,7 @@ long IRrecv::decodeNEC(decode_results *results) {
         results->decode_type = NEC;
         return DECODED;
     }
-    if (irparams.rawlen < 2 * NEC_BITS + 3) {
+    if (results->rawlen < 2 * NEC_BITS + 3) {
         return ERR;
     }
     // Initial space
@@ -886,7 +1832,7 @@ long IRrecv::decodeNEC(decode_results *results) {
 
 long IRrecv::decodeSony(decode_results *results) {
     long data = 0;
-    if (irparams.rawlen < 2 * SONY_BITS + 2) {
+    if (results->rawlen < 2 * SONY_BITS + 2) {
         return ERR;
     }
     int offset = 0; // Dont skip first space, check its size
@@ -908,7 +1854,7 @@ long IRrecv::decodeSony(decode_results *results) {
     }
     offset++;
 
-    while ((offset + 1) < irparams.rawlen) {
+    while ((offset + 1) < results->rawlen) {
         if (!MATCH_SPACE(results->rawbuf[offset], SONY_HDR_SPACE)) {
             break;
         }
@@ -940,7 +1886,7 @@ long IRrecv::decodeSony(decode_results *results) {
 // Looks like Sony except for timings, 48 chars of data and time/space different
 long IRrecv::decodeSanyo(decode_results *results) {
     long data = 0;
-    if (irparams.rawlen < 2 * SANYO_BITS + 2) {
+    if (results->rawlen < 2 * SANYO_BITS + 2) {
         return ERR;
     }
     int offset = 0; // Skip first space
@@ -972,7 +1918,7 @@ long IRrecv::decodeSanyo(decode_results *results) {
     }
     offset++;
 
-    while ((offset + 1) < irparams.rawlen) {
+    while ((offset + 1) < results->rawlen) {
         if (!MATCH_SPACE(results->rawbuf[offset], SANYO_HDR_SPACE)) {
             break;
         }
@@ -1002,9 +1948,9 @@ long IRrecv::decodeSanyo(decode_results *results) {
 
 // Looks like Sony except for timings, 48 chars of data and time/space different
 long IRrecv::decodeMitsubishi(decode_results *results) {
-    // Serial.print("?!? decoding Mitsubishi:");Serial.print(irparams.rawlen); Serial.print(" want "); Serial.println( 2 * MITSUBISHI_BITS + 2);
+    // Serial.print("?!? decoding Mitsubishi:");Serial.print(results->rawlen); Serial.print(" want "); Serial.println( 2 * MITSUBISHI_BITS + 2);
     long data = 0;
-    if (irparams.rawlen < 2 * MITSUBISHI_BITS + 2) {
+    if (results->rawlen < 2 * MITSUBISHI_BITS + 2) {
         return ERR;
     }
     int offset = 0; // Skip first space
@@ -1034,7 +1980,7 @@ long IRrecv::decodeMitsubishi(decode_results *results) {
         return ERR;
     }
     offset++;
-    while ((offset + 1) < irparams.rawlen) {
+    while ((offset + 1) < results->rawlen) {
         if (MATCH_MARK(results->rawbuf[offset], MITSUBISHI_ONE_MARK)) {
             data = (data << 1) | 1;
         }
@@ -1112,7 +2058,7 @@ int IRrecv::getRClevel(decode_results *results, int *offset, int *used, int t1)
 }
 
 long IRrecv::decodeRC5(decode_results *results) {
-    if (irparams.rawlen < MIN_RC5_SAMPLES + 2) {
+    if (results->rawlen < MIN_RC5_SAMPLES + 2) {
         return ERR;
     }
     int offset = 0; // Skip gap space
@@ -1123,7 +2069,7 @@ long IRrecv::decodeRC5(decode_results *results) {
     if (getRClevel(results, &offset, &used, RC5_T1) != SPACE) return ERR;
     if (getRClevel(results, &offset, &used, RC5_T1) != MARK) return ERR;
     int nbits;
-    for (nbits = 0; offset < irparams.rawlen; nbits++) {
+    for (nbits = 0; offset < results->rawlen; nbits++) {
         int levelA = getRClevel(results, &offset, &used, RC5_T1);
         int levelB = getRClevel(results, &offset, &used, RC5_T1);
         if (levelA == SPACE && levelB == MARK) {
@@ -1233,9 +2179,9 @@ long IRrecv::decodeJVC(decode_results *results) {
     long data = 0;
     int offset = 0; // Skip first space
     // Check for repeat
-    if (irparams.rawlen - 1 == 33 &&
+    if (results->rawlen - 1 == 33 &&
             MATCH_MARK(results->rawbuf[offset], JVC_BIT_MARK) &&
-            MATCH_MARK(results->rawbuf[irparams.rawlen - 1], JVC_BIT_MARK)) {
+            MATCH_MARK(results->rawbuf[results->rawlen - 1], JVC_BIT_MARK)) {
         results->bits = 0;
         results->value = REPEAT;
         results->decode_type = JVC;
@@ -1246,7 +2192,7 @@ long IRrecv::decodeJVC(decode_results *results) {
         return ERR;
     }
     offset++;
-    if (irparams.rawlen < 2 * JVC_BITS + 1 ) {
+    if (results->rawlen < 2 * JVC_BITS + 1 ) {
         return ERR;
     }
     // Initial space
@@ -50,6 +50,17 @@
 #define NEC_ZERO_SPACE 500
 #define NEC_RPT_SPACE	2250
 
+// IR_PHY_PPM4 BYTES frames: NEC_HDR_MARK, a shorter header space, then 4 marks per byte,
+// MSB first, each sending 2 bits in how far it is from the next mark. Marks and gaps
+// stay over the demodulator's 10 carrier cycle minimum. The symbol 0 space is only 100us
+// over the default mark_timout_us, marks stretched 75us or more merge it into the mark.
+#define PPM4_HDR_SPACE 1000
+#define PPM4_BIT_MARK  300
+#define PPM4_SPACE     300  // space after the mark for symbol 0
+#define PPM4_SPACE_STEP 300 // added per symbol value
+
+#define IR_BYTES_MIN_RAWLEN 80 // shortest IR_PHY_NEC BYTES capture decoded, shorter ones are noise
+
 #define SONY_HDR_MARK	2400
 #define SONY_HDR_SPACE	600
 #define SONY_ONE_MARK	1200
@@ -116,16 +127,27 @@
 #define DISH_BITS 16
 
 #define TOLERANCE 25  // percent tolerance in measurements
-#define LTOL (1.0 - TOLERANCE/100.)
-#define UTOL (1.0 + TOLERANCE/100.)
 
-#define TICKS_LOW(us) (int) (((us)*LTOL/USECPERTICK))
-#define TICKS_HIGH(us) (int) (((us)*UTOL/USECPERTICK + 1))
+// Accept window bounds in ticks, integer only so they fold at compile time
+#define TICKS_LOW(us) ((int) (((long)(us) * (100 - TOLERANCE)) / (100 * USECPERTICK)))
+#define TICKS_HIGH(us) ((int) (((long)(us) * (100 + TOLERANCE)) / (100 * USECPERTICK) + 1))
+
+// Protocol constants get their window baked in as template arguments, one
+// instantiation per constant, so matching them costs two integer compares
+template <int low, int high>
+static inline bool ir_match_window(int measured) {
+  static_assert(low >= 0 && low < high, "bad accept window");
+  return measured >= low && measured <= high;
+}
 
 #ifndef DEBUG_IR
-int MATCH(int measured, int desired) {return measured >= TICKS_LOW(desired) && measured <= TICKS_HIGH(desired);}
-int MATCH_MARK(int measured_ticks, int desired_us) {return MATCH(measured_ticks, (desired_us + MARK_EXCESS));}
-int MATCH_SPACE(int measured_ticks, int desired_us) {return MATCH(measured_ticks, (desired_us - MARK_EXCESS));}
+// For durations only known at run time, e.g. the RC5/RC6 bit widths
+static inline int MATCH(int measured, int desired) {return measured >= TICKS_LOW(desired) && measured <= TICKS_HIGH(desired);}
+// desired_us must be a compile time constant
+#define MATCH_MARK(measured_ticks, desired_us) \
+  ir_match_window<TICKS_LOW((desired_us) + MARK_EXCESS), TICKS_HIGH((desired_us) + MARK_EXCESS)>(measured_ticks)
+#define MATCH_SPACE(measured_ticks, desired_us) \
+  ir_match_window<TICKS_LOW((desired_us) - MARK_EXCESS), TICKS_HIGH((desired_us) - MARK_EXCESS)>(measured_ticks)
 // Debugging versions are in IRremoteLearn.cpp
 #endif
 
@@ -133,32 +155,193 @@ int MATCH_SPACE(int measured_ticks, int desired_us) {return MATCH(measured_ticks
 #define STATE_IDLE     2
 #define STATE_MARK     3
 #define STATE_SPACE    4
-#define STATE_STOP     5
-#define STATE_CAPTURED 6
+
+// BYTES stream decoder states, one MARK/SPACE pair at a time
+#define STREAM_HDR     0  // waiting for the header pair
+#define STREAM_DATA    1  // shifting in LENGTH, DATA and CRC bits
+#define STREAM_DONE    2  // all LENGTH bytes in and the CRC checked out, close on the trailing mark
+#define STREAM_BAD_CRC 3  // all LENGTH bytes in but the CRC failed, close on the trailing mark
+#define STREAM_ERR     4  // not a BYTES frame, leave it to the capture window and decoders
+
+// Link quality of a BYTES frame as its pairs come in, reported as irquality_t
+typedef struct {
+  uint16_t symbols;              // pairs classified
+  uint32_t dev_sum_us;           // their distances from the ideal timing, summed up
+  uint16_t max_dev_us;
+  uint16_t marginal;
+  int16_t header_margin_us;
+}
+irlink_t;
+
+// Outcomes of a BYTES frame for the peer counters, see IRrecv::countLink()
+#define IR_LINK_FRAME  0  // decoded
+#define IR_LINK_CRC    1  // all bytes in, bad CRC
+#define IR_LINK_DECODE 2  // cut short by a pair out of spec or a bad LENGTH/FORMAT byte
+
+// one captured frame, see irparams.frames
+typedef struct {
+  irraw_t rawbuf[RAWBUF];        // raw MARK/SPACE durations
+  unsigned long rawlen;          // counter of entries in rawbuf
+  unsigned long seq;             // capture sequence number
+  unsigned long time;            // first MARK in micro seconds, edge source clock
+  uint8_t rx_data[RX_BUF_MAX];   // bytes decoded while capturing
+  uint16_t rx_len;               // bytes in rx_data, 0 if the stream decoder failed
+  uint8_t phy;                   // IR_PHY_* of the BYTES frame in rx_data
+  uint8_t format;                // IR_FMT_* of the BYTES frame in rx_data
+  int16_t stretch_us;            // mark stretch measured on the BYTES header
+  int32_t skew_ppm;              // transmitter clock skew measured on the BYTES header
+  irlink_t link;                 // link quality of the BYTES frame in rx_data
+}
+irframe_t;
+
+// BYTES frame framing. A plain LENGTH byte counts itself, the DATA bytes and the CRC byte.
+// With IR_LEN_EXTENDED set it counts the DATA bytes only, and a FORMAT byte follows: the
+// IR_FMT_* flags as a Hamming(8,4) code byte. The CRC of an extended frame, 2 bytes with
+// IR_FMT_CRC16, covers LENGTH and FORMAT too. Receivers that predate it drop extended
+// frames on the LENGTH byte.
+#define IR_LEN_EXTENDED 0x80
+#define IR_FMT_KNOWN    (IR_FMT_FEC | IR_FMT_CRC16) // format flags this build sends and decodes
+
+// BYTES frame assembly from the bytes as sent, see ir_bytes_push()
+typedef struct {
+  uint16_t sent;                 // bytes as sent so far, LENGTH included
+  uint8_t head;                  // LENGTH byte as sent
+  uint8_t format;                // IR_FMT_* from the FORMAT byte, 0 for plain frames
+  uint8_t want;                  // DATA bytes the LENGTH byte asks for
+  uint8_t len;                   // DATA bytes stored so far
+  uint8_t checks;                // CRC bytes in so far
+  uint16_t check;                // CRC bytes as sent
+  uint8_t code;                  // first code byte of an IR_FMT_FEC pair
+  uint8_t half;                  // TRUE while code waits for its pair
+  uint8_t broken;                // TRUE once a code byte had more than one bit flipped
+  uint8_t corrected;             // bits fixed by the FEC so far
+}
+irbytes_t;
+
+// Per frame timing calibration from the BYTES header, see ir_bytes_calibrate().
+// Receiver lag stretches every mark into the space after it, a transmitter clock off
+// its nominal rate scales both. Smaller estimates than the deadbands are header jitter,
+// larger ones than the limits aren't a BYTES frame we'd decode anyway.
+typedef struct {
+  int16_t stretch_us;            // added to every mark, taken from the space after it
+  int32_t skew_ppm;              // durations are this much longer than sent, in ppm
+  int16_t scale;                 // nominal over measured, in 1/IR_CAL_ONE, for the bits
+  int16_t shift_us;              // stretch taken back from the bits, 0 within the deadband
+}
+ircal_t;
+
+#define IR_CAL_ONE              1024   // scale of a frame without clock skew
+#define IR_CAL_STRETCH_DEADBAND 40     // us, stretches as small as this are left alone
+#define IR_CAL_STRETCH_MAX      250    // us, half NEC_BIT_MARK
+#define IR_CAL_SKEW_DEADBAND    20000  // ppm, skews as small as this are left alone
+#define IR_CAL_SKEW_MAX         150000 // ppm
 
 // information for the interrupt handler
 typedef struct {
   uint8_t rxpin;                 // pin for IR rx data from detector
   uint8_t txpin;                 // pin for IR tx data from detector
-  uint8_t rcvstate;              // state machine
+  uint8_t rcvstate;              // capture state machine, run by decode()
   uint8_t blinkflag;             // TRUE to enable blinking of pin 13 on IR processing
   // unsigned int timer;         // state timer, counts 50uS ticks.
-  unsigned long rawbuf1[RAWBUF]; // raw data 1 (double buffered to receive while decoding)
-  unsigned long rawbuf2[RAWBUF]; // raw data 2
-  unsigned long rawlen;          // counter of entries in rawbuf
+  irframe_t frames[IR_FRAME_QUEUE]; // captured frames queued for decode(), plus the one being filled
+  uint8_t frame_head;            // frames[] slot being filled, free running
+  uint8_t frame_tail;            // oldest captured frame, handed to decode() until resume()
+  unsigned long frames_dropped;  // frames dropped because the queue was full
+  unsigned long rawlen;          // counter of entries in the rawbuf being filled
+  unsigned long capture_seq;     // incremented for every captured frame
   unsigned long current_time;    // current time in micro seconds
   unsigned long start_time;      // start time in micro seconds
   unsigned long end_time;        // end time in micro seconds
+  unsigned long frame_time;      // first MARK of the frame in micro seconds
+  unsigned long capture_window_us; // frame length limit in micro seconds
+  uint8_t eof_mode;              // IR_EOF_WINDOW or IR_EOF_IDLE
+  unsigned long idle_gap_us;     // silence that ends a frame in the IR_EOF_IDLE mode
+  unsigned long last_edge_time;  // last edge run through the capture state machine
   int irout_khz;                 // frequency used for PWM output
   unsigned long idle_timout_ms;  // idle timeout in milliseconds
   unsigned long mark_timout_us;  // mark timeout in microseconds
+  unsigned long min_pulse_us;    // shorter marks are glitches, 0 to accept everything
+  uint8_t require_header;        // TRUE to drop frames that don't start with a BYTES header mark
+  unsigned long glitches;        // marks shorter than min_pulse_us that were rejected
+  unsigned long headers_rejected; // frames dropped for not starting with a header mark
+  unsigned long fec_corrected;   // bits fixed by the FEC in frames that decoded
+  unsigned long calibrated;      // BYTES frames that decoded, with their calibration summed up
+  long stretch_us_sum;
+  long long skew_ppm_sum;
+  unsigned long crc_failures;    // BYTES frames with a bad CRC, counted by decodeBytes()
+  unsigned long decode_errors;   // BYTES frames cut short, counted by decodeBytes()
   uint8_t txbuf[TX_BUF_MAX];     // temporary TX buffer for sendBytes()
+  const irsymbols_t *tx_symbols; // frame being sent by sendSymbolsAsync()
+  uint8_t tx_busy;               // TRUE from sendBytesAsync() until the frame is out
+  irsend_done_t tx_done;         // sendBytesAsync() completion callback, may be NULL
+  IRrecv *csma_receiver;         // listened to before async sends, NULL to send blindly
+  unsigned long csma_quiet_us;   // line quiet this long is free
+  unsigned long csma_slot_us;    // first backoff window
+  unsigned long tx_frames;       // irsend_stats_t counters
+  unsigned long tx_deferred;
+  unsigned long tx_backoffs;
+  unsigned long tx_forced;
+  unsigned long tx_backoff_us;
+  unsigned long tx_start_time;   // last async frame started, micros()
+  unsigned long tx_end_time;     // last async frame was out, micros()
+  uint8_t echo_suppress;         // TRUE to keep capturing while we send and drop our echo
+  unsigned long echoes;          // frames dropped as our own echo
+  uint32_t edges[IR_EDGE_RING];  // edge timestamps in micro seconds, pin level in bit 0
+  uint16_t edge_head;            // next edge slot, written by the edge source only
+  uint16_t edge_tail;            // oldest unread edge, written by decode() only
+  unsigned long edge_overflows;  // edges dropped because the ring was full
+  uint8_t stream_state;          // BYTES stream decoder state for the frame being filled
+  uint8_t stream_bits;           // bits shifted into stream_byte so far
+  uint8_t stream_byte;           // byte being shifted in, MSB first
+  irbytes_t stream_bytes;        // bytes decoded into the rx_data of the frame being filled
+  uint8_t stream_phy;            // IR_PHY_* picked by the header space
+  ircal_t stream_cal;            // timing calibration from the header of the frame being filled
+  irlink_t stream_link;          // link quality of the frame being filled
 }
 irparams_t;
 
 // Defined in IRremoteLearn.cpp
 extern volatile irparams_t irparams;
 
+// BYTES frame checks: plain frames end with crc8(), an XOR of the DATA bytes that
+// misses any bit flipped twice. IR_FMT_CRC16 frames use crc16(), CRC-16/CCITT.
+#define IR_CRC16_INIT 0xFFFF
+uint8_t crc8(uint8_t data[], uint8_t len);
+uint16_t crc16(const uint8_t data[], int len, uint16_t crc=IR_CRC16_INIT);
+
+// Durations of a BYTES frame as IRsend::sendBytes() sends it on phy, MARK first,
+// into schedule[IR_TX_SCHEDULE]. A non zero format sends an extended frame.
+// Returns how many, 0 if len is over TX_BUF_MAX, IR_FMT_FEC is asked for on IR_PHY_NEC
+// or an extended frame wouldn't fit a receiver's RAWBUF.
+int ir_bytes_schedule(uint16_t *schedule, uint8_t data[], int len, uint8_t phy=IR_PHY_NEC, uint8_t format=0);
+
+// sendBytesAsync() transmit thread
+#define IR_TX_PRIORITY OS_THREAD_PRIORITY_DEFAULT // loop()'s, it takes turns with it
+#define IR_TX_STACK 1024
+#define IR_TX_WAKE_US 150 // back this long before an edge after sleeping, to switch threads
+
+// Milliseconds the transmit thread can sleep in a wait of left_us and be back for the
+// edge. A sleep of n ms ends on the n-th OS tick, 1 ms apart, n - 1 to n ms from now.
+static inline unsigned long ir_send_sleep_ms(long left_us) {
+  return (left_us > IR_TX_WAKE_US) ? (left_us - IR_TX_WAKE_US) / 1000 : 0;
+}
+
+// Frame slots by free running index
+#define IR_FRAME(index) (irparams.frames[(uint8_t)(index) & (IR_FRAME_QUEUE - 1)])
+
+// Compact a duration in microseconds into a raw buffer entry
+static inline irraw_t ir_raw_pack(unsigned long us) {
+#ifdef IR_RAW_LONG_GAPS
+  if (us > IR_RAW_SHORT_MAX) {
+    us >>= IR_RAW_LONG_SHIFT;
+    return (irraw_t)(IR_RAW_LONG_FLAG | ((us < IR_RAW_SHORT_MAX) ? us : IR_RAW_SHORT_MAX));
+  }
+  return (irraw_t)us;
+#else
+  return (irraw_t)((us < IR_RAW_MAX) ? us : IR_RAW_MAX); // saturate
+#endif
+}
+
 // IR detector output is active low
 #define MARK  0
 #define SPACE 1
@@ -0,0 +1,51 @@
+/*
+ * IRremoteLearn
+ *
+ * Binary trace records for raw IR captures, see IRrecv::setTrace().
+ * Also built into host/IRtraceReader, so keep it free of Particle APIs.
+ *
+ * Record, little endian:
+ *   u8  IR_TRACE_SYNC0, IR_TRACE_SYNC1
+ *   u8  IR_TRACE_VERSION
+ *   u16 payload length
+ *   payload:
+ *     u32 time_us      first MARK of the frame, on the edge source clock
+ *     u32 seq          capture sequence number
+ *     u16 rawlen       number of durations
+ *     u8  result       ERR or DECODED
+ *     s8  decode_type  valid if DECODED
+ *     rawlen durations, each the zigzag LEB128 varint of its difference to the
+ *     duration two entries back (the last MARK or SPACE), so steady bit timings
+ *     take a byte each
+ *   u8  XOR of the payload bytes
+ */
+
+#ifndef IRtrace_h
+#define IRtrace_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define IR_TRACE_SYNC0 0xA5
+#define IR_TRACE_SYNC1 0x5A
+#define IR_TRACE_VERSION 1
+#define IR_TRACE_HEADER 5    // sync, version and payload length
+#define IR_TRACE_FIXED 12    // payload bytes before the durations
+#define IR_TRACE_MAX(rawlen) (IR_TRACE_HEADER + IR_TRACE_FIXED + 3 * (rawlen) + 1)
+
+typedef struct {
+  uint32_t time_us;
+  uint32_t seq;
+  uint16_t rawlen;
+  uint8_t result;
+  int8_t decode_type;
+} irtrace_t;
+
+// Encode a record into buf, returns its length or 0 if buf is too small
+size_t ir_trace_encode(uint8_t *buf, size_t size, const irtrace_t *trace, const volatile uint16_t *rawbuf);
+
+// Decode the payload of a record whose header and checksum were checked,
+// durations go to rawbuf[0..max). Returns false if the payload is malformed.
+bool ir_trace_decode(const uint8_t *payload, size_t len, irtrace_t *trace, uint16_t *rawbuf, size_t max);
+
+#endif // IRtrace_h
@@ -0,0 +1,217 @@
+/*
+ * Particle Bay Area Maker Faire 2023 Badge - game protocol state machine
+ *
+ * Shared by the badge and the badge interface, keep both copies the same.
+ */
+
+#include "badge-game.h"
+
+GameMachine::GameMachine(const GameState *table, int states, uint8_t *buf, IRsend *irsend, GameSender send,
+        GameHandler onFrame)
+    : table(table), states(states), buf(buf), irsend(irsend), send(send), onFrame(onFrame), log(nullptr),
+      current(0), sends(0), sent(0), startRetransmit(0), retransmitDelay(GAME_RETRANSMIT_MS), startTimeout(0),
+      rtt(), resentTypes(0), lastFrame(), lastFrameLen(0), lastFrameMs(0), answer(), answerLen(0), answerPending(false),
+      duplicates(0) {
+    if (this->states > GAME_MAX_STATES) {
+        this->states = GAME_MAX_STATES;
+    }
+    for (int i = 0; i < this->states; i++) {
+        if (table[i].reply != GAME_NO_MESSAGE && table[i].message < 32) {
+            resentTypes |= 1UL << table[i].message;
+        }
+    }
+}
+
+void GameMachine::enter(int state) {
+    if (state < 0 || state >= states) {
+        return;
+    }
+    current = state;
+    resend();
+    if (table[current].message == GAME_NO_MESSAGE && table[current].timeout_ms) {
+        startTimeout = millis();
+    }
+    if (table[current].onEnter) {
+        table[current].onEnter();
+    }
+}
+
+void GameMachine::resend() {
+    sends = plan(current);
+    sent = 0;
+    startRetransmit = millis() - (retransmitDelay*2); // Send immediately!
+    startTimeout = 0;
+}
+
+// Resend interval before backoff: SRTT + 4 * RTTVAR once timed
+uint32_t GameMachine::rto(int state) const {
+    uint32_t ms = rtt[state].rto_ms ? rtt[state].rto_ms : table[state].rto_ms;
+    return (ms < GAME_RTO_MIN_MS) ? GAME_RTO_MIN_MS : (ms > GAME_RTO_MAX_MS) ? GAME_RTO_MAX_MS : ms;
+}
+
+// Sends that fit before the timeout, backing off and jittered late
+int GameMachine::plan(int state) const {
+    const GameState &row = table[state];
+    if (row.reply == GAME_NO_MESSAGE) {
+        return row.sends;
+    }
+    int n = 1;
+    uint32_t at = 0;
+    uint32_t interval = rto(state);
+    while (n < row.sends && at + interval * 5 / 4 < row.timeout_ms) {
+        at += interval;
+        interval *= 2;
+        n++;
+    }
+    return n;
+}
+
+// The reply to the current state's message came in
+void GameMachine::timeReply() {
+    GameRtt &r = rtt[current];
+    if (sent == 1) {
+        uint32_t ms = millis() - startRetransmit;
+        if (!r.samples) {
+            r.srtt_ms = ms;
+            r.rttvar_ms = ms / 2;
+        } else {
+            uint32_t err = (ms > r.srtt_ms) ? ms - r.srtt_ms : r.srtt_ms - ms;
+            r.rttvar_ms = (3 * r.rttvar_ms + err) / 4;
+            r.srtt_ms = (7 * r.srtt_ms + ms) / 8;
+        }
+        r.rto_ms = r.srtt_ms + 4 * r.rttvar_ms;
+        r.samples++;
+    } else {
+        // which send it answers is anyone's guess, but the round trip is no longer than
+        // since the first one: don't resend sooner than that next time, until timed again
+        uint32_t ms = millis() - startTimeout;
+        uint32_t was = rto(current);
+        r.rto_ms = (ms < was) ? was : (ms > GAME_RTO_MAX_MS) ? GAME_RTO_MAX_MS : ms;
+        r.resent++;
+    }
+    sent = 0;
+    sends = 0;
+}
+
+// Remembers the frame, true if it is a resend of the one before
+bool GameMachine::duplicate(const decode_results *results) {
+    const uint8_t *data = &results->rx_data[1];
+    int len = (results->rx_len >= 2) ? results->rx_len - 2 : 0;
+    len = (len > MESSAGE_MAX_LEN) ? MESSAGE_MAX_LEN : len;
+    uint32_t now = millis();
+    if ((resentTypes & (1UL << MessageReader(results).type())) && lastFrameLen && len == lastFrameLen &&
+            now - lastFrameMs < GAME_DUPLICATE_MS && !memcmp(data, lastFrame, len)) {
+        return true; // the window stays where the frame first came in
+    }
+    memcpy(lastFrame, data, len);
+    lastFrameLen = len;
+    lastFrameMs = now;
+    answerLen = 0;
+    answerPending = false;
+    return false;
+}
+
+void GameMachine::frame(const decode_results *results) {
+    if (duplicate(results)) {
+        duplicates++;
+        if (answerLen) {
+            answerPending = true;
+        }
+        if (log) {
+            log->printlnf("DUPLICATE%s", answerLen ? ", ANSWER AGAIN" : "");
+        }
+        return;
+    }
+
+    if (sent && table[current].reply == MessageReader(results).type()) {
+        timeReply();
+    }
+
+    int before = current;
+    GameHandler handler = table[current].onFrame ? table[current].onFrame : onFrame;
+    if (handler) {
+        handler();
+    }
+    // keep what we answer with, for when our answer gets lost and the frame comes again
+    if (current != before && table[current].message != GAME_NO_MESSAGE) {
+        answerLen = messageLength(table[current].message);
+        memcpy(answer, buf, answerLen);
+    }
+}
+
+void GameMachine::poll() {
+    if (answerPending && !irsend->busy()) {
+        answerPending = false;
+        send(answer, answerLen);
+    }
+
+    const GameState &row = table[current];
+
+    if (sends > 0 && !irsend->busy() &&
+            ((row.flags & GAME_BACK_TO_BACK) || millis() - startRetransmit > retransmitDelay)) {
+        if (!send(buf, messageLength(row.message))) {
+            // nothing went out, try again without counting it. The timeout runs from the
+            // first try so a frame that never goes out can't hold the state
+            if (log) {
+                log->printlnf("%s:%d NOT SENT", row.name, sends);
+            }
+            if (!startTimeout) {
+                startTimeout = millis();
+            }
+            retransmitDelay = GAME_RETRANSMIT_MS;
+            startRetransmit = millis();
+        } else {
+            if (log) {
+                log->printlnf("%s:%d", row.name, sends);
+            }
+            if (row.reply != GAME_NO_MESSAGE) {
+                if (!sent) {
+                    startTimeout = millis();
+                }
+                uint32_t interval = rto(current) << sent;
+                interval = (interval > GAME_RTO_MAX_MS) ? GAME_RTO_MAX_MS : interval;
+                retransmitDelay = interval * 3 / 4 + random(interval / 2 + 1);
+            } else {
+                retransmitDelay = GAME_RETRANSMIT_MS;
+            }
+            startRetransmit = millis();
+            sent++;
+            if (row.onSend) {
+                row.onSend();
+            }
+            // the handlers may have moved on to another state
+            if (&table[current] != &row) {
+                return;
+            }
+            sends--;
+            if (sends == 0) {
+                if (row.onSent) {
+                    row.onSent();
+                    return;
+                }
+                if (row.reply == GAME_NO_MESSAGE) {
+                    startTimeout = millis();
+                }
+            }
+        }
+    }
+
+    if (startTimeout && row.timeout_ms && (millis() - startTimeout > row.timeout_ms)) {
+        startTimeout = 0;
+        if (log) {
+            log->printlnf("%s TIMEOUT", row.name);
+        }
+        row.onTimeout();
+    }
+}
+
+void GameMachine::printRtt(Print *out) {
+    for (int i = 0; i < states; i++) {
+        if (table[i].reply == GAME_NO_MESSAGE) {
+            continue;
+        }
+        out->printlnf("GAME %s srtt:%lums rttvar:%lums rto:%lums timed:%lu resent:%lu", table[i].name,
+                rtt[i].srtt_ms, rtt[i].rttvar_ms, rto(i), rtt[i].samples, rtt[i].resent);
+    }
+    out->printlnf("GAME duplicates:%lu", duplicates);
+}